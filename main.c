@@ -1,176 +1,4228 @@
+#define _GNU_SOURCE  // mremap
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <assert.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
-#define MIN_CHUNK_SIZE 4       // Smallest chunk size (must be a power of 2)
+#define MIN_CHUNK_SIZE 8       // Smallest chunk size (must hold a FreeBlock)
 #define MAX_CHUNK_SIZE 65536   // Largest chunk size (must be a power of 2)
-#define CHUNK_CLASSES 14       // Number of chunk classes (4, 8, 16, ..., 65536)
+#define CHUNK_CLASSES 45       // Number of chunk classes (8, 16, 32, 48, ..., then 4 per doubling up to 65536)
+
+#define SMALL_LOOKUP_MAX 1024  // Sizes up to here are looked up in 8 byte steps, larger ones in 128 byte steps
+
+#define TCACHE_MAX_BATCH 32              // Most blocks moved between a thread cache and the central lists at once
+#define TCACHE_BATCH_BYTES (64 * 1024)   // Bytes worth of blocks moved per batch for the larger chunk classes
+
+#define TAG_SHIFT 48                          // Central list heads keep an ABA tag above the 48-bit address
+#define TAG_PTR_MASK ((1ULL << TAG_SHIFT) - 1)
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define ARENA_REGION_SIZE (64 * 1024 * 1024)  // Address space reserved by each arena mmap
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)      // Arena regions are aligned to this when backed by huge pages
+#define MM_MAX_NODES 64                       // NUMA nodes with an arena of their own, the rest share node 0's
+
+#define HUGE_THRESHOLD (4 * 1024 * 1024)      // Larger requests get their own mmap instead of a page run
+#define REGION_MIN_CHUNK (64 * 1024)          // First chunk of a region, each new one is twice the last
+#define REGION_MAX_CHUNK (1024 * 1024)        // up to this
+#define RUN_BINS (HUGE_THRESHOLD / PAGE_SIZE + 1)  // Free page runs binned by page count (last bin: longer)
+#define RUN_BIN_WORDS ((RUN_BINS + 63) / 64)
+#define HUGE_CACHE_SLOTS 16                   // Freed huge mappings kept around for reuse
+#define HUGE_CACHE_BYTES (256 * 1024 * 1024)  // Most bytes the huge cache may hold
+
+#define SLAB_MIN_SIZE (64 * 1024)             // Slabs carved on demand are at least this big...
+#define SLAB_MIN_BLOCKS 8                     // ...and hold at least this many blocks
+#define SLAB_MAX_SIZE (2 * 1024 * 1024)       // Slabs double up to this size while a class keeps missing...
+#define SLAB_GROW_MS 1000                     // ...with at most this long between misses
+
+#define PURGE_PASSES 4                        // Decay purger passes per decay period
+
+#define PERCPU_MAX_CPUS 1024                  // CPUs with a per-CPU cache, threads on others use the central lists
+#define PERCPU_SLOTS 64                       // Blocks a per-CPU cache holds per class (2 batches, at most this)
+
+#define PAGEMAP_LEAF_BITS 18                  // Page map: 48-bit addresses, 36-bit page numbers, split 18/18
+#define PAGEMAP_ROOT_BITS (48 - PAGE_SHIFT - PAGEMAP_LEAF_BITS)
 
 #define TOTAL_MEMORY (10 * 1024 * 1024)  // 10MB
 
-// Linked list for free memory blocks
-typedef struct FreeBlock {
-    struct FreeBlock *next;
-} FreeBlock;
+// Linked list for free memory blocks
+typedef struct FreeBlock {
+    struct FreeBlock *next;
+} FreeBlock;
+
+// Head of a lock-free (Treiber) stack of free blocks: block address in the low 48 bits,
+// a counter in the high 16 bits that changes on every update so a stale CAS cannot succeed (ABA)
+typedef uint64_t TaggedList;
+
+// Central free list of one chunk class on one NUMA node: what every central pop and push touches,
+// on a cache line of its own so threads refilling different classes or nodes don't false-share
+typedef struct {
+    TaggedList free_list;      // Free blocks of slabs on this node, shared by all threads
+    size_t central_count;      // Blocks on the list
+} __attribute__((aligned(64))) CentralList;
+
+// Central state of one chunk class, across nodes. Each class has cache lines of its own: the first
+// holds the counters note_demand() reads, the second is only written on a miss.
+typedef struct {
+    size_t peak;               // Most blocks off the central list at once: the class's demand
+    size_t use_epoch;          // Purger pass in which the central list was last popped
+    size_t preallocated;       // Blocks preallocated
+    size_t fallback;           // Blocks carved on demand once the free lists ran dry
+    size_t purged;             // Blocks of idle slabs given back to the page heap
+    size_t misses __attribute__((aligned(64)));  // Times the free lists ran dry
+    size_t carve_blocks;       // Blocks in the next slab carved on a miss
+    uint64_t last_miss_ms;
+} __attribute__((aligned(64))) CentralClass;
+
+// Memory manager structure
+typedef struct {
+    CentralList lists[MM_MAX_NODES][CHUNK_CLASSES];  // Only the first mm_numa_nodes are used
+    CentralClass classes[CHUNK_CLASSES];
+} MemoryManager;
+
+MemoryManager mem_manager;  // Zero-initialized: all lists start empty
+
+// A thread's restartable sequence area (struct rseq in linux/rseq.h): the kernel keeps cpu_id up to
+// date, and restarts the critical section rseq_cs points to when the thread is preempted or migrated.
+typedef struct {
+    uint32_t cpu_id_start;
+    uint32_t cpu_id;
+    uint64_t rseq_cs;
+    uint32_t flags;
+} __attribute__((aligned(32))) MMRseq;
+
+// One class of a thread cache: everything mm_malloc/mm_free touch for it is in one 32 byte entry,
+// so a call touches a single cache line instead of one per array
+typedef struct {
+    FreeBlock *free_list;  // Thread-local free list
+    size_t count;          // Number of blocks on it
+    size_t allocs;
+    size_t frees;
+} ThreadCacheClass;
+
+// Per-thread cache of free blocks. mm_malloc/mm_free only touch this on the fast path,
+// and move blocks to/from the central lists in mem_manager in batches.
+// It also counts this thread's allocations and frees, which mm_stats() adds up across threads.
+// Hot fields first: the classes at offset 0 (so a class is addressed straight off the thread
+// pointer), then the fields every call reads, then what only slow paths use.
+typedef struct ThreadCache {
+    ThreadCacheClass classes[CHUNK_CLASSES];
+    int initialized;
+    uint8_t owner;                        // This thread's remote queue, 0 if it got none
+    uint8_t node;                         // NUMA node the thread started on: its slabs and page runs come from there
+    MMRseq *rseq;                         // Per-CPU mode: blocks are cached per CPU instead, NULL if not
+    struct ThreadCache *next;             // All live thread caches, for mm_stats()
+    struct ThreadCache *prev;
+    uint8_t outbox_owner[CHUNK_CLASSES];  // Freed blocks of another thread's slabs, sent to this owner
+    FreeBlock *outbox[CHUNK_CLASSES];     // a batch at a time
+    FreeBlock *outbox_tail[CHUNK_CLASSES];
+    size_t outbox_counts[CHUNK_CLASSES];
+} ThreadCache;
+
+// Remote frees: slabs carved on a miss belong to the thread that missed. A thread keeps the blocks
+// it frees while its cache has room, since its next malloc wants them hot. Once the cache is full
+// (a consumer freeing what a producer allocated), blocks of another thread's slabs go back to that
+// thread through its remote queue, instead of to the central list where every thread contends,
+// so memory does not pile up on the freeing side. The owner takes the whole list with one exchange
+// on its next miss in that class. Queue numbers are reused once a thread exits; blocks are
+// interchangeable, so whoever owns the number next simply gets them.
+#define REMOTE_OWNERS 255  // Queue numbers fit the page map's owner byte, 0 is "no owner"
+#define REMOTE_MAX_BATCHES 4  // An owner not taking blocks back gets no more than this many batches
+
+typedef struct {
+    FreeBlock *heads[CHUNK_CLASSES];  // Pushed by any thread, taken all at once by the owner
+    size_t counts[CHUNK_CLASSES];     // Upper bound of the blocks on each list
+    int active;                       // Claimed by a live thread
+} __attribute__((aligned(64))) RemoteQueue;
+
+static RemoteQueue remote_queues[REMOTE_OWNERS + 1];
+
+// initial-exec: inside libmm.so the default TLS model would call __tls_get_addr on every access
+static __thread ThreadCache tcache __attribute__((tls_model("initial-exec"), aligned(64)));
+
+// Arena that slabs of same-sized blocks are carved from. Memory comes from large mmap'd
+// regions and is handed out with a bump pointer, so blocks carry no per-block header.
+// There is one arena per NUMA node, with its regions bound to that node.
+typedef struct {
+    char *next;            // Next free byte in the current region
+    char *end;             // End of the current region
+    size_t mapped;         // Total bytes mapped from the OS
+    pthread_mutex_t lock;
+} Arena;
+
+Arena arenas[MM_MAX_NODES] = { [0 ... MM_MAX_NODES - 1] = { NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER } };
+
+// NUMA nodes arenas are kept for, 1 (everything in arenas[0], nothing bound) unless mm_init finds
+// more than one node and no memory policy set by the user (numactl --membind etc.), which wins.
+int mm_numa_nodes = 1;
+
+enum { MM_HUGE_OFF, MM_HUGE_THP, MM_HUGE_HUGETLB };
+
+// How arena regions are backed: 4 KiB pages, transparent huge pages (MADV_HUGEPAGE) or reserved
+// huge pages (MAP_HUGETLB, falling back to THP when none are reserved). -1 until the first region
+// is mapped, which reads MM_HUGE_PAGES=thp|hugetlb from the environment so libmm.so can use them.
+// Arenas of different NUMA nodes map regions under different locks, so it is only accessed atomically.
+int mm_huge_pages = -1;
+
+enum { SPAN_FREE, SPAN_SLAB, SPAN_LARGE, SPAN_HUGE };
+
+// A run of contiguous pages: a slab of small blocks, a large allocation, a huge mapping or a free run.
+// The descriptor lives outside the run so free runs cost no memory inside them.
+typedef struct Span {
+    struct Span *next;    // Free run bin / unused descriptor list
+    struct Span *prev;
+    char *start;
+    size_t npages;
+    size_t nblocks;       // Blocks carved from a slab
+    uint8_t state;
+    uint8_t chunk_class;
+    uint8_t purged;       // Free runs: pages already given back to the kernel
+    uint8_t node;         // Page runs: NUMA node of the arena they were carved from
+    size_t age;           // Huge mappings: when it was cached, the oldest is evicted first
+    uint64_t idle_since;  // Free runs and cached huge mappings: when they were freed (ms)
+    size_t nfree;         // Slabs: free blocks counted by the purger
+} Span;
+
+// Page-granular allocations above MAX_CHUNK_SIZE: page runs up to HUGE_THRESHOLD, mmap above.
+// Both keep freed memory around so large buffers are recycled instead of returned to the kernel.
+typedef struct {
+    Span *run_bins[RUN_BINS];         // Free page runs by page count
+    uint64_t run_bin_mask[RUN_BIN_WORDS];  // One bit per bin that is not empty
+    Span *free_spans;                 // Unused Span descriptors
+    Span *huge_cache[HUGE_CACHE_SLOTS];
+    size_t huge_cached_bytes;
+    size_t huge_age;
+    size_t free_bytes;                // Bytes in free page runs...
+    size_t purged_bytes;              // ...and how many of them were given back to the kernel
+    size_t huge_mapped_bytes;         // Huge mappings in use or cached
+    size_t large_allocs;              // Allocations above MAX_CHUNK_SIZE, updated atomically
+    size_t large_frees;
+    size_t large_bytes;               // Pages they currently occupy
+    pthread_mutex_t lock;
+} PageHeap;
+
+PageHeap page_heap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Page map: a two level radix tree from page number to the Span owning the page. Slabs register
+// every page with their chunk class (stored +1, so 0 means "not a small block") which lets
+// mm_free find the class of any block with two dependent loads. The high byte of the same entry
+// is the remote queue of the thread the slab belongs to. Other spans register their first and
+// last page, which is all that freeing and coalescing need.
+typedef struct {
+    uint16_t classes[1 << PAGEMAP_LEAF_BITS];
+    Span *spans[1 << PAGEMAP_LEAF_BITS];
+} PageMapLeaf;
+
+static PageMapLeaf *pagemap_root[1 << PAGEMAP_ROOT_BITS];
+static pthread_mutex_t pagemap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t mm_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;           // Only used so thread exit flushes the cache
+size_t batch_sizes[CHUNK_CLASSES];         // Blocks moved per refill/flush for each chunk size
+
+// Chunk sizes: 16 byte steps up to 128, then 4 classes per doubling, so a request wastes at most ~20%
+size_t chunk_sizes[] = {
+    8, 16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096,
+    5120, 6144, 7168, 8192,
+    10240, 12288, 14336, 16384,
+    20480, 24576, 28672, 32768,
+    40960, 49152, 57344, 65536
+};
+
+// Size -> chunk class lookup tables, filled in by init_size_classes()
+static uint8_t small_class_index[SMALL_LOOKUP_MAX / 8 + 1];
+static uint8_t large_class_index[MAX_CHUNK_SIZE / 128 + 1];
+
+void mm_init(void);
+
+// Get index for chunk size (smallest chunk size greater than or equal to `size`)
+size_t get_chunk_index(size_t size) {
+    if (size <= SMALL_LOOKUP_MAX) return small_class_index[(size + 7) >> 3];
+    return large_class_index[(size + 127) >> 7];
+}
+
+// The chunk class of a size (1 to MAX_CHUNK_SIZE) worked out from how the classes are laid out
+// instead of looked up, so it folds to a constant when the size is one, e.g. sizeof a struct
+static inline size_t size_class(size_t size) {
+    if (size <= 8) return 0;
+    if (size <= 128) return (size + 15) / 16;
+    size_t shift = 63 - __builtin_clzll(size - 1);  // 2^shift < size <= 2^(shift + 1), in 4 steps
+    size_t step = (size_t)1 << (shift - 2);
+    return 8 + (shift - 7) * 4 + (size - ((size_t)1 << shift) + step - 1) / step;
+}
+
+// chunk_sizes[index] worked out the same way, so it folds to a constant too
+static inline size_t class_size(size_t index) {
+    if (index <= 8) return index ? index * 16 : 8;
+    size_t shift = 7 + (index - 9) / 4;
+    return (5 + (index - 9) % 4) << (shift - 2);
+}
+
+// Fill the lookup tables. Every chunk size up to SMALL_LOOKUP_MAX is a multiple of 8 and every
+// larger one a multiple of 128, so one entry per step always maps to a single class.
+static void init_size_classes(void) {
+    size_t index = 0;
+    for (size_t i = 0; i <= SMALL_LOOKUP_MAX / 8; i++) {
+        while (chunk_sizes[index] < i * 8) index++;
+        small_class_index[i] = index;
+    }
+    for (size_t i = SMALL_LOOKUP_MAX / 128 + 1; i <= MAX_CHUNK_SIZE / 128; i++) {
+        while (chunk_sizes[index] < i * 128) index++;
+        large_class_index[i] = index;
+    }
+}
+
+static inline FreeBlock *tagged_block(TaggedList list) {
+    return (FreeBlock *)(uintptr_t)(list & TAG_PTR_MASK);
+}
+
+static inline TaggedList tagged_next(TaggedList old, FreeBlock *block) {
+    return (((old >> TAG_SHIFT) + 1) << TAG_SHIFT) | (uintptr_t)block;
+}
+
+// Push an already linked chain of `count` blocks (head..tail) onto a node's central list with a single CAS
+static void central_push_node(size_t node, size_t index, FreeBlock *head, FreeBlock *tail, size_t count) {
+    TaggedList *list = &mem_manager.lists[node][index].free_list;
+    TaggedList old = __atomic_load_n(list, __ATOMIC_RELAXED);
+    do {
+        tail->next = tagged_block(old);
+    } while (!__atomic_compare_exchange_n(list, &old, tagged_next(old, head), 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_fetch_add(&mem_manager.lists[node][index].central_count, count, __ATOMIC_RELAXED);
+}
+
+// Pop up to `max` blocks off a node's central list with a single CAS. Returns the chain (NULL if
+// empty), its last block in `*tail_out` and its length in `*count`.
+static FreeBlock *central_pop_node(size_t node, size_t index, size_t max, FreeBlock **tail_out, size_t *count) {
+    TaggedList *list = &mem_manager.lists[node][index].free_list;
+    TaggedList old = __atomic_load_n(list, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        FreeBlock *head = tagged_block(old);
+        if (!head) {
+            *count = 0;
+            return NULL;
+        }
+
+        // Walk the chain. Another thread may pop and reuse these blocks under us, so after every
+        // link we read, re-check the head: if it is unchanged nothing was popped and the link is valid.
+        // Blocks are never unmapped, so reading a reused block is harmless.
+        FreeBlock *tail = head;
+        FreeBlock *next = __atomic_load_n(&tail->next, __ATOMIC_RELAXED);
+        size_t n = 1;
+        int stale = 0;
+        while (n < max && next) {
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(list, __ATOMIC_RELAXED) != old) {
+                stale = 1;
+                break;
+            }
+            tail = next;
+            next = __atomic_load_n(&tail->next, __ATOMIC_RELAXED);
+            n++;
+        }
+
+        if (stale) {
+            old = __atomic_load_n(list, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(list, &old, tagged_next(old, next), 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            __atomic_fetch_sub(&mem_manager.lists[node][index].central_count, n, __ATOMIC_RELAXED);
+            *tail_out = tail;
+            *count = n;
+            return head;
+        }
+    }
+}
+
+// Bytes each block of a chunk class occupies in a slab (a free block must still hold a FreeBlock)
+static size_t block_stride(size_t index) {
+    return chunk_sizes[index] < sizeof(FreeBlock) ? sizeof(FreeBlock) : chunk_sizes[index];
+}
+
+// Map a new region for the arena. Pages are only touched (and become resident) when carved.
+static void *map_region(size_t size) {
+    void *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return region == MAP_FAILED ? NULL : region;
+}
+
+// Map a region aligned to HUGE_PAGE_SIZE, so every 2 MiB of it can become one huge page
+static void *map_aligned_region(size_t size) {
+    char *region = map_region(size + HUGE_PAGE_SIZE);
+    if (!region) return NULL;
+
+    char *aligned = (char *)(((uintptr_t)region + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > region) munmap(region, aligned - region);
+    if (aligned < region + HUGE_PAGE_SIZE) munmap(aligned + size, region + HUGE_PAGE_SIZE - aligned);
+    return aligned;
+}
+
+#define NUMA_MPOL_DEFAULT 0  // mbind/get_mempolicy modes (numaif.h, without needing libnuma)
+#define NUMA_MPOL_PREFERRED 1
+#define NUMA_MPOL_LOCAL 4
+#define NUMA_MPOL_F_NODE 1
+#define NUMA_MPOL_F_ADDR 2
+
+// Prefer `node` for the pages of a region. Preferred, not bound: a full node spills over instead of
+// failing the page fault. Does nothing (and costs nothing) on a single node.
+static void numa_bind(void *region, size_t size, size_t node) {
+    if (mm_numa_nodes <= 1) return;
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, region, size, NUMA_MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+}
+
+// Count the NUMA nodes from /sys (read without stdio, the preload shim may be inside malloc here).
+// Kernels without NUMA fail get_mempolicy and stay at one node, as does MM_NUMA=off.
+static void numa_init(void) {
+    const char *mode = getenv("MM_NUMA");
+    if (mode && !strcmp(mode, "off")) return;
+    int policy;
+    if (syscall(SYS_get_mempolicy, &policy, NULL, 0, NULL, 0) != 0) return;
+    if (policy != NUMA_MPOL_DEFAULT && policy != NUMA_MPOL_LOCAL) return;
+
+    char online[256];
+    int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    ssize_t len = read(fd, online, sizeof(online) - 1);
+    close(fd);
+    if (len <= 0) return;
+    online[len] = 0;
+
+    // A list of ranges like "0-3,8": the highest node number is what matters
+    int nodes = 0, value = 0;
+    for (char *c = online; *c; c++) {
+        if (*c >= '0' && *c <= '9') {
+            value = value * 10 + (*c - '0');
+            if (value + 1 > nodes) nodes = value + 1;
+        } else {
+            value = 0;
+        }
+    }
+    mm_numa_nodes = nodes > MM_MAX_NODES ? MM_MAX_NODES : nodes < 1 ? 1 : nodes;
+}
+
+// NUMA node of the CPU the calling thread runs on
+static size_t current_node(void) {
+    unsigned cpu, node;
+    if (mm_numa_nodes <= 1 || syscall(SYS_getcpu, &cpu, &node, NULL) != 0) return 0;
+    return node < (unsigned)mm_numa_nodes ? node : 0;
+}
+
+// Map a new arena region with the backing mm_huge_pages asks for. Called with its arena's lock held.
+static void *map_arena_region(size_t size) {
+    int mode = __atomic_load_n(&mm_huge_pages, __ATOMIC_RELAXED);
+    if (mode < 0) {
+        // Only the first regions of each node get here, and they all read the same environment
+        const char *env = getenv("MM_HUGE_PAGES");
+        int from_env = !env ? MM_HUGE_OFF :
+                       !strcmp(env, "hugetlb") ? MM_HUGE_HUGETLB :
+                       !strcmp(env, "thp") ? MM_HUGE_THP : MM_HUGE_OFF;
+        // Keep the mode mm_set_huge_pages or another node may have set meanwhile
+        if (__atomic_compare_exchange_n(&mm_huge_pages, &mode, from_env, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            mode = from_env;
+        }
+    }
+    if (mode == MM_HUGE_OFF) return map_region(size);
+
+    size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+    if (mode == MM_HUGE_HUGETLB) {
+        // No MAP_NORESERVE: the mmap has to fail now, not with SIGBUS on the first unreserved page
+        void *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region != MAP_FAILED) return region;
+        // No huge pages reserved, don't try again for every region (unless the mode changed meanwhile)
+        __atomic_compare_exchange_n(&mm_huge_pages, &mode, MM_HUGE_THP, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+
+    void *region = map_aligned_region(size);
+    if (region) madvise(region, size, MADV_HUGEPAGE);
+    return region;
+}
+
+// Change how arena regions are backed. The current region is retired, so the next slab or page run
+// comes from a region with the new backing; its untouched tail costs no RSS. The mode is set before
+// any region is retired, so no node maps a region the old way after the call returns.
+void mm_set_huge_pages(int mode) {
+    __atomic_store_n(&mm_huge_pages, mode, __ATOMIC_RELAXED);
+    for (size_t node = 0; node < MM_MAX_NODES; node++) {
+        pthread_mutex_lock(&arenas[node].lock);
+        arenas[node].next = arenas[node].end = NULL;
+        pthread_mutex_unlock(&arenas[node].lock);
+    }
+}
+
+// Bump-allocate `size` bytes (rounded up to whole pages) from the arena of a NUMA node
+static void *arena_alloc(size_t size, size_t node) {
+    Arena *arena = &arenas[node];
+    size = (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+
+    pthread_mutex_lock(&arena->lock);
+    if ((size_t)(arena->end - arena->next) < size) {
+        // The tail of the old region is abandoned, it was never touched so it costs no RSS
+        size_t region_size = size > ARENA_REGION_SIZE ? size : ARENA_REGION_SIZE;
+        char *region = map_arena_region(region_size);
+        if (!region) {
+            pthread_mutex_unlock(&arena->lock);
+            return NULL;
+        }
+        numa_bind(region, region_size, node);
+        arena->next = region;
+        arena->end = region + region_size;
+        arena->mapped += region_size;
+    }
+    void *ptr = arena->next;
+    arena->next += size;
+    pthread_mutex_unlock(&arena->lock);
+    return ptr;
+}
+
+static inline PageMapLeaf *pagemap_leaf(uintptr_t page) {
+    if (page >> (PAGEMAP_ROOT_BITS + PAGEMAP_LEAF_BITS)) return NULL;  // Not a 48-bit address
+    return __atomic_load_n(&pagemap_root[page >> PAGEMAP_LEAF_BITS], __ATOMIC_ACQUIRE);
+}
+
+// Chunk class + 1 of the small block at `ptr`, 0 if it is not a small block
+static inline size_t pagemap_class(const void *ptr) {
+    uintptr_t page = (uintptr_t)ptr >> PAGE_SHIFT;
+    PageMapLeaf *leaf = pagemap_leaf(page);
+    return leaf ? leaf->classes[page & ((1 << PAGEMAP_LEAF_BITS) - 1)] & 0xff : 0;
+}
+
+// pagemap_class, also returning the remote queue of the slab's owner thread (0: none)
+static inline size_t pagemap_class_owner(const void *ptr, size_t *owner) {
+    uintptr_t page = (uintptr_t)ptr >> PAGE_SHIFT;
+    PageMapLeaf *leaf = pagemap_leaf(page);
+    if (!leaf) return 0;
+    size_t entry = leaf->classes[page & ((1 << PAGEMAP_LEAF_BITS) - 1)];
+    *owner = entry >> 8;
+    return entry & 0xff;
+}
+
+static inline Span *pagemap_span(const void *ptr) {
+    uintptr_t page = (uintptr_t)ptr >> PAGE_SHIFT;
+    PageMapLeaf *leaf = pagemap_leaf(page);
+    return leaf ? leaf->spans[page & ((1 << PAGEMAP_LEAF_BITS) - 1)] : NULL;
+}
+
+// Point the pages [first, first + npages) at `span`. Leaves are mapped on first use, untouched
+// parts of a leaf never become resident.
+static void pagemap_set(char *first, size_t npages, Span *span, size_t chunk_class, size_t owner) {
+    for (uintptr_t page = (uintptr_t)first >> PAGE_SHIFT; npages > 0; page++, npages--) {
+        PageMapLeaf *leaf = pagemap_leaf(page);
+        if (!leaf) {
+            pthread_mutex_lock(&pagemap_lock);
+            leaf = pagemap_root[page >> PAGEMAP_LEAF_BITS];
+            if (!leaf) {
+                leaf = map_region(sizeof(PageMapLeaf));
+                if (!leaf) {
+                    printf("Failed to allocate page map\n");
+                    exit(1);
+                }
+                __atomic_store_n(&pagemap_root[page >> PAGEMAP_LEAF_BITS], leaf, __ATOMIC_RELEASE);
+            }
+            pthread_mutex_unlock(&pagemap_lock);
+        }
+        leaf->spans[page & ((1 << PAGEMAP_LEAF_BITS) - 1)] = span;
+        leaf->classes[page & ((1 << PAGEMAP_LEAF_BITS) - 1)] = chunk_class | owner << 8;
+    }
+}
+
+// Register the first and last page of a span that is not a slab
+static void pagemap_set_ends(Span *span) {
+    pagemap_set(span->start, 1, span, 0, 0);
+    if (span->npages > 1) pagemap_set(span->start + (span->npages - 1) * PAGE_SIZE, 1, span, 0, 0);
+}
+
+// Get a Span descriptor, carving a fresh page of them when none are left. Called with page_heap.lock held.
+static Span *span_alloc(void) {
+    if (!page_heap.free_spans) {
+        Span *spans = arena_alloc(PAGE_SIZE, 0);
+        if (!spans) return NULL;
+        for (size_t i = 0; i < PAGE_SIZE / sizeof(Span); i++) {
+            spans[i].next = page_heap.free_spans;
+            page_heap.free_spans = &spans[i];
+        }
+    }
+    Span *span = page_heap.free_spans;
+    page_heap.free_spans = span->next;
+    memset(span, 0, sizeof(Span));
+    return span;
+}
+
+static void span_free(Span *span) {
+    span->next = page_heap.free_spans;
+    page_heap.free_spans = span;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// A cheap timestamp for timing single operations: the TSC where there is one, else nanoseconds
+static inline uint64_t cpu_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return monotonic_ns();
+#endif
+}
+
+static inline size_t run_bin(size_t npages) {
+    return npages < RUN_BINS ? npages : RUN_BINS - 1;
+}
+
+// Free runs are kept in doubly linked bins so coalescing can unlink a neighbour directly
+static void run_insert(Span *span) {
+    Span **bin = &page_heap.run_bins[run_bin(span->npages)];
+    span->state = SPAN_FREE;
+    span->prev = NULL;
+    span->next = *bin;
+    if (*bin) (*bin)->prev = span;
+    *bin = span;
+    size_t index = bin - page_heap.run_bins;
+    page_heap.run_bin_mask[index / 64] |= 1ULL << (index % 64);
+    pagemap_set_ends(span);
+
+    page_heap.free_bytes += span->npages * PAGE_SIZE;
+    if (span->purged) page_heap.purged_bytes += span->npages * PAGE_SIZE;
+}
+
+static void run_remove(Span *span) {
+    if (span->prev) {
+        span->prev->next = span->next;
+    } else {
+        size_t bin = run_bin(span->npages);
+        page_heap.run_bins[bin] = span->next;
+        if (!span->next) page_heap.run_bin_mask[bin / 64] &= ~(1ULL << (bin % 64));
+    }
+    if (span->next) span->next->prev = span->prev;
+
+    page_heap.free_bytes -= span->npages * PAGE_SIZE;
+    if (span->purged) page_heap.purged_bytes -= span->npages * PAGE_SIZE;
+}
+
+// The first bin from `bin` on that holds a free run, RUN_BINS if there is none
+static inline size_t next_run_bin(size_t bin) {
+    size_t word = bin / 64;
+    if (word >= RUN_BIN_WORDS) return RUN_BINS;
+    uint64_t bits = page_heap.run_bin_mask[word] & (~0ULL << (bin % 64));
+    while (!bits) {
+        if (++word == RUN_BIN_WORDS) return RUN_BINS;
+        bits = page_heap.run_bin_mask[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+// Allocate a run of `npages` pages on the calling thread's NUMA node, reusing (and splitting) a free
+// run of that node when there is one. The returned span is registered in the page map as a large allocation.
+static Span *page_alloc(size_t npages) {
+    Span *span = NULL;
+    size_t node = tcache.node;
+
+    pthread_mutex_lock(&page_heap.lock);
+    for (size_t bin = next_run_bin(run_bin(npages)); bin < RUN_BINS && !span; bin = next_run_bin(bin + 1)) {
+        for (Span *run = page_heap.run_bins[bin]; run; run = run->next) {
+            if (run->npages < npages) continue;  // Only happens in the last bin
+            if (run->node != node) continue;
+
+            run_remove(run);
+            if (run->npages > npages) {
+                // Keep the rest of the run for later
+                Span *rest = span_alloc();
+                if (rest) {
+                    rest->start = run->start + npages * PAGE_SIZE;
+                    rest->npages = run->npages - npages;
+                    rest->purged = run->purged;
+                    rest->node = run->node;
+                    rest->idle_since = run->idle_since;
+                    run_insert(rest);
+                    run->npages = npages;
+                }
+            }
+            span = run;
+            break;
+        }
+    }
+
+    if (!span) {
+        char *start = arena_alloc(npages * PAGE_SIZE, node);
+        span = start ? span_alloc() : NULL;
+        if (!span) {
+            pthread_mutex_unlock(&page_heap.lock);
+            return NULL;
+        }
+        span->start = start;
+        span->npages = npages;
+        span->node = node;
+    }
+    span->state = SPAN_LARGE;
+    span->purged = 0;
+    span->nfree = 0;  // A run released by the purger may still count the free blocks of its old slab
+    pagemap_set_ends(span);
+    pthread_mutex_unlock(&page_heap.lock);
+    return span;
+}
+
+// Give a page run back to the page heap, merging it with free neighbours of the same NUMA node. The
+// merged run counts as freshly freed and not purged; purging pages that already were is cheap.
+static void page_free(Span *span) {
+    pthread_mutex_lock(&page_heap.lock);
+    span->purged = 0;
+    span->idle_since = now_ms();
+
+    Span *prev = pagemap_span(span->start - PAGE_SIZE);
+    if (prev && prev->state == SPAN_FREE && prev->node == span->node) {
+        run_remove(prev);
+        prev->npages += span->npages;
+        prev->purged = 0;
+        prev->idle_since = span->idle_since;
+        span_free(span);
+        span = prev;
+    }
+    Span *next = pagemap_span(span->start + span->npages * PAGE_SIZE);
+    if (next && next->state == SPAN_FREE && next->node == span->node) {
+        run_remove(next);
+        span->npages += next->npages;
+        span_free(next);
+    }
+    run_insert(span);
+
+    pthread_mutex_unlock(&page_heap.lock);
+}
+
+// Huge mappings are rounded to a quarter of their power of 2, so a freed mapping can serve any
+// later request that rounds to the same size
+static size_t huge_round(size_t size) {
+    size_t step = (size_t)1 << (63 - __builtin_clzll(size - 1) - 2);
+    if (step < PAGE_SIZE) step = PAGE_SIZE;
+    return (size + step - 1) & ~(step - 1);
+}
+
+// Reuse the smallest cached mapping that fits, as long as it is at most twice the size we need.
+// The excess tail is unmapped, the head keeps its already faulted-in pages.
+static Span *huge_alloc(size_t size) {
+    size_t npages = huge_round(size) / PAGE_SIZE;
+    size_t best = HUGE_CACHE_SLOTS;
+
+    pthread_mutex_lock(&page_heap.lock);
+    for (size_t i = 0; i < HUGE_CACHE_SLOTS; i++) {
+        Span *cached = page_heap.huge_cache[i];
+        if (cached && cached->npages >= npages && cached->npages <= 2 * npages &&
+            (best == HUGE_CACHE_SLOTS || cached->npages < page_heap.huge_cache[best]->npages)) {
+            best = i;
+        }
+    }
+
+    if (best != HUGE_CACHE_SLOTS) {
+        Span *span = page_heap.huge_cache[best];
+        page_heap.huge_cache[best] = NULL;
+        page_heap.huge_cached_bytes -= span->npages * PAGE_SIZE;
+        pthread_mutex_unlock(&page_heap.lock);
+
+        if (span->npages > npages) {
+            munmap(span->start + npages * PAGE_SIZE, (span->npages - npages) * PAGE_SIZE);
+            __atomic_fetch_sub(&page_heap.huge_mapped_bytes, (span->npages - npages) * PAGE_SIZE, __ATOMIC_RELAXED);
+            span->npages = npages;
+        }
+        return span;
+    }
+
+    char *start = map_region(npages * PAGE_SIZE);
+    Span *span = start ? span_alloc() : NULL;
+    if (span) {
+        numa_bind(start, npages * PAGE_SIZE, tcache.node);
+        span->start = start;
+        span->npages = npages;
+        span->state = SPAN_HUGE;
+        pagemap_set(start, 1, span, 0, 0);
+        __atomic_fetch_add(&page_heap.huge_mapped_bytes, npages * PAGE_SIZE, __ATOMIC_RELAXED);
+    } else if (start) {
+        munmap(start, npages * PAGE_SIZE);
+    }
+    pthread_mutex_unlock(&page_heap.lock);
+    return span;
+}
+
+static void huge_free(Span *span) {
+    size_t map_size = span->npages * PAGE_SIZE;
+    Span *evicted[HUGE_CACHE_SLOTS + 1];
+    size_t num_evicted = 0;
+
+    pthread_mutex_lock(&page_heap.lock);
+    if (map_size > HUGE_CACHE_BYTES) {
+        evicted[num_evicted++] = span;
+    } else {
+        // Evict the oldest mappings until there is a free slot and room in the byte budget
+        for (;;) {
+            Span **slot = NULL, **oldest = NULL;
+            for (size_t i = 0; i < HUGE_CACHE_SLOTS; i++) {
+                Span **cached = &page_heap.huge_cache[i];
+                if (!*cached) {
+                    slot = cached;
+                } else if (!oldest || (*cached)->age < (*oldest)->age) {
+                    oldest = cached;
+                }
+            }
+            if (slot && page_heap.huge_cached_bytes + map_size <= HUGE_CACHE_BYTES) {
+                span->age = page_heap.huge_age++;
+                span->idle_since = now_ms();
+                *slot = span;
+                page_heap.huge_cached_bytes += map_size;
+                break;
+            }
+
+            evicted[num_evicted++] = *oldest;
+            page_heap.huge_cached_bytes -= (*oldest)->npages * PAGE_SIZE;
+            *oldest = NULL;
+        }
+    }
+
+    // Forget evicted mappings before unmapping them, the address range can be reused right away
+    for (size_t i = 0; i < num_evicted; i++) {
+        pagemap_set(evicted[i]->start, 1, NULL, 0, 0);
+    }
+    pthread_mutex_unlock(&page_heap.lock);
+
+    for (size_t i = 0; i < num_evicted; i++) {
+        munmap(evicted[i]->start, evicted[i]->npages * PAGE_SIZE);
+        __atomic_fetch_sub(&page_heap.huge_mapped_bytes, evicted[i]->npages * PAGE_SIZE, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&page_heap.lock);
+        span_free(evicted[i]);
+        pthread_mutex_unlock(&page_heap.lock);
+    }
+}
+
+// Requests above MAX_CHUNK_SIZE: a page run, or a dedicated mapping above HUGE_THRESHOLD
+static void *large_alloc(size_t size) {
+    Span *span = size > HUGE_THRESHOLD ? huge_alloc(size) : page_alloc((size + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (!span) return NULL;
+
+    __atomic_fetch_add(&page_heap.large_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&page_heap.large_bytes, span->npages * PAGE_SIZE, __ATOMIC_RELAXED);
+    return span->start;
+}
+
+static void large_free(void *ptr) {
+    Span *span = pagemap_span(ptr);
+    if (!span || span->start != (char *)ptr) return;  // Not something we handed out
+    if (span->state != SPAN_HUGE && span->state != SPAN_LARGE) return;
+
+    __atomic_fetch_add(&page_heap.large_frees, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&page_heap.large_bytes, span->npages * PAGE_SIZE, __ATOMIC_RELAXED);
+    if (span->state == SPAN_HUGE) {
+        huge_free(span);
+    } else {
+        page_free(span);
+    }
+}
+
+// Resize a page run in place: give trailing pages back, or take pages from the free run or the
+// untouched arena right behind it. Returns 0 if the run cannot grow where it is.
+static int page_resize(Span *span, size_t npages) {
+    if (npages == span->npages) return 1;
+
+    pthread_mutex_lock(&page_heap.lock);
+    if (npages < span->npages) {
+        Span *rest = span_alloc();
+        if (rest) {  // Without a descriptor the run just keeps its pages
+            rest->start = span->start + npages * PAGE_SIZE;
+            rest->npages = span->npages - npages;
+            rest->state = SPAN_LARGE;
+            rest->node = span->node;
+            span->npages = npages;
+            pagemap_set_ends(span);
+            pagemap_set_ends(rest);
+        }
+        pthread_mutex_unlock(&page_heap.lock);
+        if (rest) page_free(rest);
+        return 1;
+    }
+
+    char *end = span->start + span->npages * PAGE_SIZE;
+    size_t needed = npages - span->npages;
+    Span *next = pagemap_span(end);
+    int grown = 0;
+    if (next && next->state == SPAN_FREE && next->start == end && next->npages >= needed && next->node == span->node) {
+        run_remove(next);
+        if (next->npages > needed) {
+            next->start += needed * PAGE_SIZE;
+            next->npages -= needed;
+            run_insert(next);
+        } else {
+            span_free(next);
+        }
+        grown = 1;
+    } else {
+        // The last run carved from the arena can bump the arena pointer
+        Arena *arena = &arenas[span->node];
+        pthread_mutex_lock(&arena->lock);
+        if (arena->next == end && (size_t)(arena->end - arena->next) >= needed * PAGE_SIZE) {
+            arena->next += needed * PAGE_SIZE;
+            grown = 1;
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+    if (grown) {
+        span->npages = npages;
+        pagemap_set_ends(span);
+    }
+    pthread_mutex_unlock(&page_heap.lock);
+    return grown;
+}
+
+// Resize a huge mapping with mremap, which moves the pages instead of copying them when it cannot
+// grow in place. Returns NULL when the allocation should move to a page run instead.
+static void *huge_resize(Span *span, size_t size) {
+    if (size <= HUGE_THRESHOLD) return NULL;
+    size_t npages = huge_round(size) / PAGE_SIZE;
+    if (npages == span->npages) return span->start;
+
+    pthread_mutex_lock(&page_heap.lock);
+    char *start = mremap(span->start, span->npages * PAGE_SIZE, npages * PAGE_SIZE, MREMAP_MAYMOVE);
+    if (start == MAP_FAILED) {
+        pthread_mutex_unlock(&page_heap.lock);
+        return NULL;
+    }
+    if (start != span->start) {
+        pagemap_set(span->start, 1, NULL, 0, 0);
+        pagemap_set(start, 1, span, 0, 0);
+        span->start = start;
+    }
+    __atomic_fetch_add(&page_heap.huge_mapped_bytes, (npages - span->npages) * PAGE_SIZE, __ATOMIC_RELAXED);
+    span->npages = npages;
+    pthread_mutex_unlock(&page_heap.lock);
+    return start;
+}
+
+// A page run starting at a multiple of `alignment` (a power of 2 above PAGE_SIZE): over-allocate, then
+// give the pages before the aligned start and behind the end back to the page heap
+static Span *page_alloc_aligned(size_t npages, size_t alignment) {
+    Span *span = page_alloc(npages + alignment / PAGE_SIZE - 1);
+    if (!span) return NULL;
+
+    uintptr_t aligned = ((uintptr_t)span->start + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    size_t lead = (aligned - (uintptr_t)span->start) / PAGE_SIZE;
+    if (lead) {
+        pthread_mutex_lock(&page_heap.lock);
+        Span *head = span_alloc();
+        if (head) {
+            head->start = span->start;
+            head->npages = lead;
+            head->state = SPAN_LARGE;
+            head->node = span->node;
+            span->start += lead * PAGE_SIZE;
+            span->npages -= lead;
+            pagemap_set_ends(head);
+            pagemap_set_ends(span);
+        }
+        pthread_mutex_unlock(&page_heap.lock);
+        if (!head) {
+            page_free(span);
+            return NULL;
+        }
+        page_free(head);
+    }
+    page_resize(span, npages);
+    return span;
+}
+
+// Resize a large allocation without copying, NULL if it has to be copied
+static void *large_resize(Span *span, size_t size) {
+    if (size <= MAX_CHUNK_SIZE) return NULL;  // Small enough for a chunk class
+
+    size_t old_pages = span->npages;
+    void *resized = NULL;
+    if (span->state == SPAN_HUGE) {
+        resized = huge_resize(span, size);
+    } else if (span->state == SPAN_LARGE && page_resize(span, (size + PAGE_SIZE - 1) / PAGE_SIZE)) {
+        resized = span->start;
+    }
+    if (resized) {
+        __atomic_fetch_add(&page_heap.large_bytes, (span->npages - old_pages) * PAGE_SIZE, __ATOMIC_RELAXED);
+    }
+    return resized;
+}
+
+// Push a chain of free blocks to the central lists of the nodes their slabs are on, so memory freed
+// on one node is not handed to threads of another while that node has blocks of its own
+static void central_push(size_t index, FreeBlock *head, FreeBlock *tail, size_t count) {
+    if (mm_numa_nodes <= 1) {
+        central_push_node(0, index, head, tail, count);
+        return;
+    }
+
+    // Relink the chain into one chain per node (its tail is not needed)
+    FreeBlock *heads[MM_MAX_NODES], *tails[MM_MAX_NODES];
+    size_t counts[MM_MAX_NODES] = { 0 };
+    for (FreeBlock *block = head, *next; count > 0; block = next, count--) {
+        next = block->next;
+        size_t node = pagemap_span(block)->node;
+        block->next = counts[node] ? heads[node] : NULL;
+        if (!counts[node]) tails[node] = block;
+        heads[node] = block;
+        counts[node]++;
+    }
+    for (size_t node = 0; node < (size_t)mm_numa_nodes; node++) {
+        if (counts[node]) central_push_node(node, index, heads[node], tails[node], counts[node]);
+    }
+}
+
+// Free blocks of a class on the central lists of all nodes
+static size_t central_free(size_t index) {
+    size_t total = 0;
+    for (size_t node = 0; node < (size_t)mm_numa_nodes; node++) {
+        total += __atomic_load_n(&mem_manager.lists[node][index].central_count, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+// Carve `count` contiguous blocks of one chunk class out of the page heap and push them on its central
+// list. Frees from other threads send the blocks to the remote queue `owner` (0: keep them).
+// Returns 0 if the page heap is out of memory.
+static int carve_slab(size_t index, size_t count, size_t owner) {
+    size_t stride = block_stride(index);
+    Span *span = page_alloc((count * stride + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (!span) return 0;
+    char *slab = span->start;
+
+    // Every page of a slab maps to its class, so any block can be freed without its size
+    span->state = SPAN_SLAB;
+    span->chunk_class = index;
+    span->nblocks = count;
+    pagemap_set(slab, span->npages, span, index + 1, owner);
+
+    // Link the blocks in address order, then publish the whole slab at once
+    for (size_t n = 0; n + 1 < count; n++) {
+        ((FreeBlock *)(slab + n * stride))->next = (FreeBlock *)(slab + (n + 1) * stride);
+    }
+    central_push(index, (FreeBlock *)slab, (FreeBlock *)(slab + (count - 1) * stride), count);
+    return 1;
+}
+
+// Blocks per slab when a class runs dry: at least SLAB_MIN_BLOCKS, filling at least SLAB_MIN_SIZE
+static size_t slab_blocks(size_t index) {
+    size_t stride = block_stride(index);
+    size_t bytes = SLAB_MIN_BLOCKS * stride;
+    if (bytes < SLAB_MIN_SIZE) bytes = SLAB_MIN_SIZE;
+    bytes = (bytes + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    return bytes / stride;
+}
+
+// Carve each class's preallocated blocks as one contiguous slab
+static void preallocate_counts(const size_t *counts) {
+    for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+        if (counts[i]) {
+            if (!carve_slab(i, counts[i], 0)) {
+                printf("Failed to allocate memory\n");
+                exit(1);
+            }
+            mem_manager.classes[i].preallocated += counts[i];
+        }
+    }
+}
+
+// Evenly distribute preallocated memory across chunk sizes in a cyclic manner
+void preallocate_memory(size_t total_memory) {
+    mm_init();
+
+    size_t allocated_memory = 0;
+    size_t counts[CHUNK_CLASSES] = {0};
+    size_t i = 0; // Start at the smallest chunk size
+
+    // Work out how many blocks each class gets, one block at each chunk size in order
+    while (allocated_memory + chunk_sizes[i] <= total_memory*2) {
+        counts[i]++;
+        allocated_memory += chunk_sizes[i];
+
+        // Move to the next chunk size (loop back to 0 if needed)
+        i = (i + 1) % CHUNK_CLASSES;
+    }
+
+    preallocate_counts(counts);
+    printf("Preallocated %zu bytes of memory in a cyclic manner across all chunk sizes (%zu bytes mapped).\n",
+           allocated_memory, arenas[0].mapped);
+}
+
+// Decay purger: a background thread that gives memory idle for `decay_ms` back to the kernel.
+// - Free page runs are purged with MADV_DONTNEED, cached huge mappings are unmapped.
+// - Classes whose central list was not popped for a decay period get scanned: the purger pops the
+//   whole list, and slabs whose blocks are all on it go back to the page heap as free runs (and are
+//   purged one decay period later). Blocks in thread caches keep their slab alive.
+// The fast path only pays for noting which purger pass last refilled a thread cache.
+static pthread_mutex_t purge_lock = PTHREAD_MUTEX_INITIALIZER;  // Held for a whole pass
+static uint64_t decay_ms;          // 0: never purge
+static size_t purge_epoch;         // Purger passes so far
+static int purge_running;
+
+// Note that a class is in use. Only stores when a new pass started, so hot classes don't keep
+// dirtying mem_manager.
+static inline void class_used(size_t index) {
+    size_t epoch = __atomic_load_n(&purge_epoch, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&mem_manager.classes[index].use_epoch, __ATOMIC_RELAXED) != epoch) {
+        __atomic_store_n(&mem_manager.classes[index].use_epoch, epoch, __ATOMIC_RELAXED);
+    }
+}
+
+// Give the fully free slabs of an idle class on one node back to the page heap. All free blocks of
+// a slab that are on the central lists are on its node's list.
+static void purge_class(size_t node, size_t index) {
+    FreeBlock *tail, *block, *next;
+    size_t count;
+    FreeBlock *head = central_pop_node(node, index, SIZE_MAX, &tail, &count);
+    if (!head) return;
+
+    // Count the free blocks of each slab, then keep the blocks of slabs that are not entirely free.
+    // The first block of a fully free slab queues it for release.
+    for (block = head; count > 0; block = block->next, count--) {
+        pagemap_span(block)->nfree++;
+    }
+    FreeBlock *keep_head = NULL, *keep_tail = NULL;
+    size_t kept = 0;
+    Span *released = NULL;
+    for (block = head; block; block = next) {
+        next = block->next;
+        Span *span = pagemap_span(block);
+        if (span->nfree == span->nblocks) {
+            if (span->state == SPAN_SLAB) {
+                span->state = SPAN_LARGE;
+                span->next = released;
+                released = span;
+            }
+            continue;
+        }
+        span->nfree = 0;
+        block->next = keep_head;
+        keep_head = block;
+        if (!keep_tail) keep_tail = block;
+        kept++;
+    }
+    if (keep_head) central_push_node(node, index, keep_head, keep_tail, kept);
+
+    while (released) {
+        Span *span = released;
+        released = span->next;
+        __atomic_fetch_add(&mem_manager.classes[index].purged, span->nblocks, __ATOMIC_RELAXED);
+        span->nfree = 0;
+        pagemap_set(span->start, span->npages, span, 0, 0);
+        page_free(span);
+    }
+}
+
+// Purge free runs and evict cached huge mappings that were idle for `decay` ms
+static void purge_page_heap(uint64_t now, uint64_t decay) {
+    Span *evicted[HUGE_CACHE_SLOTS];
+    size_t num_evicted = 0;
+
+    pthread_mutex_lock(&page_heap.lock);
+    for (size_t bin = next_run_bin(0); bin < RUN_BINS; bin = next_run_bin(bin + 1)) {
+        for (Span *run = page_heap.run_bins[bin]; run; run = run->next) {
+            if (run->purged || now - run->idle_since < decay) continue;
+            madvise(run->start, run->npages * PAGE_SIZE, MADV_DONTNEED);
+            run->purged = 1;
+            page_heap.purged_bytes += run->npages * PAGE_SIZE;
+        }
+    }
+    for (size_t i = 0; i < HUGE_CACHE_SLOTS; i++) {
+        Span *cached = page_heap.huge_cache[i];
+        if (!cached || now - cached->idle_since < decay) continue;
+        page_heap.huge_cache[i] = NULL;
+        page_heap.huge_cached_bytes -= cached->npages * PAGE_SIZE;
+        pagemap_set(cached->start, 1, NULL, 0, 0);
+        evicted[num_evicted++] = cached;
+    }
+    pthread_mutex_unlock(&page_heap.lock);
+
+    for (size_t i = 0; i < num_evicted; i++) {
+        munmap(evicted[i]->start, evicted[i]->npages * PAGE_SIZE);
+        __atomic_fetch_sub(&page_heap.huge_mapped_bytes, evicted[i]->npages * PAGE_SIZE, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&page_heap.lock);
+        span_free(evicted[i]);
+        pthread_mutex_unlock(&page_heap.lock);
+    }
+}
+
+static void *purge_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        uint64_t decay = __atomic_load_n(&decay_ms, __ATOMIC_RELAXED);
+        uint64_t interval = decay ? decay / PURGE_PASSES : 100;  // Disabled: just check back later
+        struct timespec pause = { interval / 1000, (interval % 1000) * 1000000 + 1000000 };
+        nanosleep(&pause, NULL);
+
+        pthread_mutex_lock(&purge_lock);
+        decay = decay_ms;
+        if (decay) {
+            size_t epoch = __atomic_add_fetch(&purge_epoch, 1, __ATOMIC_RELAXED);
+            for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+                if (epoch - __atomic_load_n(&mem_manager.classes[i].use_epoch, __ATOMIC_RELAXED) > PURGE_PASSES) {
+                    for (size_t node = 0; node < (size_t)mm_numa_nodes; node++) purge_class(node, i);
+                }
+            }
+            purge_page_heap(now_ms(), decay);
+        }
+        pthread_mutex_unlock(&purge_lock);
+    }
+    return NULL;
+}
+
+// Purge memory idle for `ms` milliseconds from now on, 0 to stop. Starts the purger thread on first
+// use and waits for a pass in progress, so no pass runs after mm_set_decay(0) returns.
+void mm_set_decay(uint64_t ms) {
+    mm_init();
+    pthread_mutex_lock(&purge_lock);
+    decay_ms = ms;
+    if (ms && !purge_running) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, purge_thread, NULL) == 0) {
+            pthread_detach(thread);
+            purge_running = 1;
+        }
+    }
+    pthread_mutex_unlock(&purge_lock);
+}
+
+// Move up to `count` blocks from a thread cache list back to the central list
+static void tcache_flush(ThreadCache *cache, size_t index, size_t count) {
+    FreeBlock *head = cache->classes[index].free_list;
+    if (!head) return;
+
+    // Walk to the last block we are giving back so the whole chain is spliced in one step
+    FreeBlock *tail = head;
+    size_t moved = 1;
+    while (moved < count && tail->next) {
+        tail = tail->next;
+        moved++;
+    }
+    cache->classes[index].free_list = tail->next;
+    cache->classes[index].count -= moved;
+
+    central_push(index, head, tail, moved);
+}
+
+// Take every block other threads sent back to `queue` in one class, with its tail and length
+static FreeBlock *remote_take(RemoteQueue *queue, size_t index, FreeBlock **tail, size_t *count) {
+    if (!__atomic_load_n(&queue->heads[index], __ATOMIC_RELAXED)) return NULL;
+    FreeBlock *head = __atomic_exchange_n(&queue->heads[index], NULL, __ATOMIC_ACQUIRE);
+    if (!head) return NULL;
+
+    FreeBlock *last = head;
+    size_t n = 1;
+    while (last->next) {
+        last = last->next;
+        n++;
+    }
+    __atomic_fetch_sub(&queue->counts[index], n, __ATOMIC_RELAXED);
+    *tail = last;
+    *count = n;
+    return head;
+}
+
+// Send a class's outbox to its owner with one CAS. If the owner is gone, or already has
+// REMOTE_MAX_BATCHES it is not taking back, the blocks stay in this thread's cache instead.
+static void outbox_send(ThreadCache *cache, size_t index) {
+    FreeBlock *head = cache->outbox[index];
+    if (!head) return;
+    FreeBlock *tail = cache->outbox_tail[index];
+    size_t count = cache->outbox_counts[index];
+    cache->outbox[index] = NULL;
+    cache->outbox_counts[index] = 0;
+
+    RemoteQueue *queue = &remote_queues[cache->outbox_owner[index]];
+    size_t queued = __atomic_load_n(&queue->counts[index], __ATOMIC_RELAXED);
+    if (__atomic_load_n(&queue->active, __ATOMIC_RELAXED) && queued + count <= REMOTE_MAX_BATCHES * batch_sizes[index]) {
+        __atomic_fetch_add(&queue->counts[index], count, __ATOMIC_RELAXED);  // Before the push: never below the truth
+        FreeBlock *old = __atomic_load_n(&queue->heads[index], __ATOMIC_RELAXED);
+        do {
+            tail->next = old;
+        } while (!__atomic_compare_exchange_n(&queue->heads[index], &old, head, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        return;
+    }
+
+    tail->next = cache->classes[index].free_list;
+    cache->classes[index].free_list = head;
+    cache->classes[index].count += count;
+    if (cache->classes[index].count > 2 * batch_sizes[index]) {
+        tcache_flush(cache, index, cache->classes[index].count - batch_sizes[index]);
+    }
+}
+
+// Per-CPU caches: with thousands of threads, thread caches hold thousands of batches per class. In
+// per-CPU mode (MM_PERCPU=1, or mm_set_percpu) threads instead share one cache per CPU, so cached
+// memory follows the core count. The cache of the CPU a thread runs on is updated with restartable
+// sequences: a short critical section that ends in a single committing store, which the kernel
+// restarts from the top if the thread is preempted or migrated before the commit. So no atomics or
+// locks are needed, like tcmalloc's per-CPU mode. Threads that cannot use rseq (older kernels and
+// libcs, other architectures) keep their thread cache.
+typedef struct {
+    uint32_t counts[CHUNK_CLASSES];
+    FreeBlock *slots[CHUNK_CLASSES][PERCPU_SLOTS] __attribute__((aligned(64)));  // Stacks, top at counts[]
+} PerCpuCache;
+
+static PerCpuCache *percpu_caches;           // PERCPU_MAX_CPUS of them, mapped on first use
+static uint32_t percpu_capacity[CHUNK_CLASSES];
+int mm_percpu = -1;                          // -1 until mm_init reads MM_PERCPU
+
+#if defined(__x86_64__) && defined(__linux__)
+#define RSEQ_SIG 0x53053053  // Precedes every abort handler; glibc registers with the same one
+
+// glibc 2.35+ registers an rseq area for every thread and exports where it is. Weak, so older
+// glibcs still link: there the thread registers its own.
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+static __thread MMRseq own_rseq __attribute__((tls_model("initial-exec")));
+static __thread int own_rseq_state __attribute__((tls_model("initial-exec")));  // 1: registered, -1: refused
+
+// The calling thread's rseq area, NULL if it has none and cannot register one
+static MMRseq *rseq_register(void) {
+    if (&__rseq_size && __rseq_size) {
+        char *thread_pointer;
+        __asm__("movq %%fs:0, %0" : "=r"(thread_pointer));
+        MMRseq *rseq = (MMRseq *)(thread_pointer + __rseq_offset);
+        return (int32_t)rseq->cpu_id >= 0 ? rseq : NULL;
+    }
+#ifdef SYS_rseq
+    if (!own_rseq_state) own_rseq_state = syscall(SYS_rseq, &own_rseq, sizeof(own_rseq), 0, RSEQ_SIG) == 0 ? 1 : -1;
+    if (own_rseq_state > 0) return &own_rseq;
+#endif
+    return NULL;
+}
+
+// The critical section's descriptor goes in __rseq_cs, its abort handler (after the signature) in
+// __rseq_failure, out of the way of the fast path. An abort simply starts over.
+#define RSEQ_BEGIN                                    \
+    ".pushsection __rseq_cs, \"aw\"\n\t"              \
+    ".balign 32\n\t"                                  \
+    "3:\n\t"                                          \
+    ".long 0, 0\n\t"                                  \
+    ".quad 1f, 2f - 1f, 4f\n\t"                       \
+    ".popsection\n\t"                                 \
+    ".pushsection __rseq_failure, \"ax\"\n\t"         \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                      \
+    ".long 0x53053053\n\t"                            \
+    "4:\n\t"                                          \
+    "jmp 0f\n\t"                                      \
+    ".popsection\n\t"                                 \
+    "0:\n\t"                                          \
+    "leaq 3b(%%rip), %%rax\n\t"                       \
+    "movq %%rax, %[rseq_cs]\n\t"                      \
+    "1:\n\t"                                          \
+    "movl %[cpu_id], %%eax\n\t"                       \
+    "cmpl %[max_cpus], %%eax\n\t"                     \
+    "jae 5f\n\t"                                      \
+    "imulq %[stride], %%rax, %%rax\n\t"               \
+    "addq %[base], %%rax\n\t"                         \
+    "movl (%%rax, %[count_offset]), %%ecx\n\t"
+
+// Pop a block off this CPU's cache of a class, NULL if it is empty
+static inline void *percpu_pop(MMRseq *rseq, size_t index) {
+    void *block;
+    __asm__ __volatile__(
+        RSEQ_BEGIN
+        "testl %%ecx, %%ecx\n\t"
+        "jz 5f\n\t"
+        "subl $1, %%ecx\n\t"
+        "leaq (%%rax, %[slot_offset]), %%rdx\n\t"
+        "movq (%%rdx, %%rcx, 8), %[block]\n\t"
+        "movl %%ecx, (%%rax, %[count_offset])\n\t"  // Commit
+        "2:\n\t"
+        "jmp 6f\n\t"
+        "5:\n\t"
+        "xorl %k[block], %k[block]\n\t"
+        "6:\n\t"
+        : [block] "=&r"(block), [rseq_cs] "=m"(rseq->rseq_cs)
+        : [cpu_id] "m"(rseq->cpu_id), [max_cpus] "i"(PERCPU_MAX_CPUS), [stride] "i"(sizeof(PerCpuCache)),
+          [base] "r"(percpu_caches), [count_offset] "r"(index * sizeof(uint32_t)),
+          [slot_offset] "r"(offsetof(PerCpuCache, slots) + index * PERCPU_SLOTS * sizeof(FreeBlock *))
+        : "rax", "rcx", "rdx", "memory", "cc");
+    return block;
+}
+
+// Push a block onto this CPU's cache of a class, 0 if it is full
+static inline int percpu_push(MMRseq *rseq, size_t index, void *block) {
+    int pushed;
+    __asm__ __volatile__(
+        RSEQ_BEGIN
+        "cmpl %[capacity], %%ecx\n\t"
+        "jae 5f\n\t"
+        "leaq (%%rax, %[slot_offset]), %%rdx\n\t"
+        "movq %[block], (%%rdx, %%rcx, 8)\n\t"
+        "addl $1, %%ecx\n\t"
+        "movl %%ecx, (%%rax, %[count_offset])\n\t"  // Commit
+        "2:\n\t"
+        "movl $1, %[pushed]\n\t"
+        "jmp 6f\n\t"
+        "5:\n\t"
+        "movl $0, %[pushed]\n\t"
+        "6:\n\t"
+        : [pushed] "=&r"(pushed), [rseq_cs] "=m"(rseq->rseq_cs)
+        : [cpu_id] "m"(rseq->cpu_id), [max_cpus] "i"(PERCPU_MAX_CPUS), [stride] "i"(sizeof(PerCpuCache)),
+          [base] "r"(percpu_caches), [count_offset] "r"(index * sizeof(uint32_t)),
+          [slot_offset] "r"(offsetof(PerCpuCache, slots) + index * PERCPU_SLOTS * sizeof(FreeBlock *)),
+          [capacity] "r"(percpu_capacity[index]), [block] "r"(block)
+        : "rax", "rcx", "rdx", "memory", "cc");
+    return pushed;
+}
+#else
+static MMRseq *rseq_register(void) { return NULL; }
+static inline void *percpu_pop(MMRseq *rseq, size_t index) { (void)rseq; (void)index; return NULL; }
+static inline int percpu_push(MMRseq *rseq, size_t index, void *block) { (void)rseq; (void)index; (void)block; return 0; }
+#endif
+
+static pthread_mutex_t percpu_setup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Map the per-CPU caches once. Only pages of CPUs that threads run on ever become resident.
+static int percpu_setup(void) {
+    pthread_mutex_lock(&percpu_setup_lock);
+    if (!__atomic_load_n(&percpu_caches, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&percpu_caches, map_region(PERCPU_MAX_CPUS * sizeof(PerCpuCache)), __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&percpu_setup_lock);
+    return percpu_caches != NULL;
+}
+
+// Thread caches registered for mm_stats(), and the counts of threads that already exited
+static ThreadCache *tcache_list;
+static size_t retired_allocs[CHUNK_CLASSES];
+static size_t retired_frees[CHUNK_CLASSES];
+static pthread_mutex_t tcache_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Thread exit: send the outboxes, hand every cached block back to the central lists, give up the
+// remote queue (moving what it holds to the central lists) and keep the thread's counts
+static void tcache_destroy(void *arg) {
+    ThreadCache *cache = (ThreadCache *)arg;
+    for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+        outbox_send(cache, i);
+        tcache_flush(cache, i, cache->classes[i].count);
+    }
+    if (cache->owner) {
+        // A free racing with this can still land in the queue: the next thread to claim it gets the block
+        RemoteQueue *queue = &remote_queues[cache->owner];
+        __atomic_store_n(&queue->active, 0, __ATOMIC_RELEASE);
+        for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+            FreeBlock *tail;
+            size_t count;
+            FreeBlock *head = remote_take(queue, i, &tail, &count);
+            if (head) central_push(i, head, tail, count);
+        }
+        cache->owner = 0;
+    }
+
+    pthread_mutex_lock(&tcache_list_lock);
+    for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+        retired_allocs[i] += cache->classes[i].allocs;
+        retired_frees[i] += cache->classes[i].frees;
+        cache->classes[i].allocs = cache->classes[i].frees = 0;
+    }
+    if (cache->prev) {
+        cache->prev->next = cache->next;
+    } else {
+        tcache_list = cache->next;
+    }
+    if (cache->next) cache->next->prev = cache->prev;
+    pthread_mutex_unlock(&tcache_list_lock);
+    cache->initialized = 0;
+}
+
+// fork() in a threaded program: take every allocator lock so the child does not inherit one held
+// by a thread that no longer exists. Lock order is the one the purger and page_alloc use; the
+// per-CPU setup and thread cache list locks are never held with another one, so they go first.
+static void mm_prefork(void) {
+    pthread_mutex_lock(&percpu_setup_lock);
+    pthread_mutex_lock(&tcache_list_lock);
+    pthread_mutex_lock(&purge_lock);
+    pthread_mutex_lock(&page_heap.lock);
+    for (size_t node = 0; node < MM_MAX_NODES; node++) pthread_mutex_lock(&arenas[node].lock);
+    pthread_mutex_lock(&pagemap_lock);
+}
+
+static void mm_postfork(void) {
+    pthread_mutex_unlock(&pagemap_lock);
+    for (size_t node = MM_MAX_NODES; node-- > 0;) pthread_mutex_unlock(&arenas[node].lock);
+    pthread_mutex_unlock(&page_heap.lock);
+    pthread_mutex_unlock(&purge_lock);
+    pthread_mutex_unlock(&tcache_list_lock);
+    pthread_mutex_unlock(&percpu_setup_lock);
+}
+
+// The child has no purger thread, the next mm_set_decay starts one. Its other threads are gone too:
+// their remote queues are free for new threads, which take over what is in them.
+static void mm_postfork_child(void) {
+    purge_running = 0;
+    for (size_t i = 1; i <= REMOTE_OWNERS; i++) {
+        if (i != tcache.owner) remote_queues[i].active = 0;
+    }
+    mm_postfork();
+}
+
+// One-time setup of the size class tables, NUMA nodes, batch sizes, cache mode, the thread exit hook and the fork handlers
+static void mm_init_once(void) {
+    init_size_classes();
+    numa_init();
+    for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+        // Move ~TCACHE_BATCH_BYTES at a time, but never fewer than 2 or more than TCACHE_MAX_BATCH blocks
+        size_t batch = TCACHE_BATCH_BYTES / chunk_sizes[i];
+        if (batch < 2) batch = 2;
+        if (batch > TCACHE_MAX_BATCH) batch = TCACHE_MAX_BATCH;
+        batch_sizes[i] = batch;
+        percpu_capacity[i] = 2 * batch > PERCPU_SLOTS ? PERCPU_SLOTS : 2 * batch;
+    }
+    if (mm_percpu < 0) {
+        const char *percpu = getenv("MM_PERCPU");
+        mm_percpu = percpu && !strcmp(percpu, "1");
+    }
+    pthread_key_create(&tcache_key, tcache_destroy);
+    pthread_atfork(mm_prefork, mm_postfork, mm_postfork_child);
+}
+
+void mm_init(void) {
+    pthread_once(&mm_once, mm_init_once);
+}
+
+// Switch per-CPU caches on or off for threads that allocate for the first time from now on. Returns
+// whether the calling thread could use them, i.e. whether this kernel and libc support rseq.
+int mm_set_percpu(int enable) {
+    mm_init();
+    mm_percpu = enable;
+    return enable && percpu_setup() && rseq_register() != NULL;
+}
+
+static void tcache_init(void) {
+    mm_init();
+    pthread_setspecific(tcache_key, &tcache);  // Non-NULL value so tcache_destroy runs at thread exit
+    tcache.node = current_node();
+    tcache.rseq = mm_percpu > 0 && percpu_setup() ? rseq_register() : NULL;
+
+    pthread_mutex_lock(&tcache_list_lock);
+    tcache.prev = NULL;
+    tcache.next = tcache_list;
+    if (tcache_list) tcache_list->prev = &tcache;
+    tcache_list = &tcache;
+    pthread_mutex_unlock(&tcache_list_lock);
+
+    // Past REMOTE_OWNERS live threads the rest carve slabs that nobody owns. Per-CPU caches need
+    // no remote queue: blocks go back to whichever CPU frees them.
+    for (size_t i = 1; i <= REMOTE_OWNERS && !tcache.owner && !tcache.rseq; i++) {
+        int inactive = 0;
+        if (__atomic_compare_exchange_n(&remote_queues[i].active, &inactive, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            tcache.owner = i;
+        }
+    }
+    tcache.initialized = 1;
+}
+
+// Fallback: carve a new slab if no preallocated blocks are available. Like tcmalloc's slow start,
+// a class that keeps missing gets slabs twice as big each time, up to SLAB_MAX_SIZE; once its misses
+// are more than SLAB_GROW_MS apart it is back to slab_blocks(). Returns 0 if out of memory.
+static int carve_fallback(size_t index) {
+    uint64_t now = now_ms();
+    uint64_t last = __atomic_exchange_n(&mem_manager.classes[index].last_miss_ms, now, __ATOMIC_RELAXED);
+    size_t base = slab_blocks(index);
+    size_t count = __atomic_load_n(&mem_manager.classes[index].carve_blocks, __ATOMIC_RELAXED);
+    if (!count || now - last > SLAB_GROW_MS) count = base;
+
+    if (!carve_slab(index, count, tcache.owner)) return 0;
+    __atomic_fetch_add(&mem_manager.classes[index].fallback, count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mem_manager.classes[index].misses, 1, __ATOMIC_RELAXED);
+
+    size_t max = SLAB_MAX_SIZE / block_stride(index);
+    size_t next = count * 2 > max ? max : count * 2;
+    __atomic_store_n(&mem_manager.classes[index].carve_blocks, next > base ? next : base, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Take up to `max` blocks from the central list of the calling thread's node, carving a new slab
+// there when it is empty. Blocks freed on other nodes stay there for their own threads; they are
+// only used once this node's memory runs out.
+static FreeBlock *central_refill(size_t index, size_t max, FreeBlock **tail, size_t *moved) {
+    size_t local = tcache.node;
+    FreeBlock *head;
+    while (!(head = central_pop_node(local, index, max, tail, moved))) {
+        if (carve_fallback(index)) continue;
+        for (size_t n = 1; n < (size_t)mm_numa_nodes && !head; n++) {
+            head = central_pop_node((local + n) % mm_numa_nodes, index, max, tail, moved);
+        }
+        if (head) break;
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    return head;
+}
+
+// Record how many blocks of a class are off the central list (in use or in thread caches) after
+// a pop. The peak is the demand a preallocation profile asks for.
+static void note_demand(size_t index) {
+    size_t carved = __atomic_load_n(&mem_manager.classes[index].preallocated, __ATOMIC_RELAXED) +
+                    __atomic_load_n(&mem_manager.classes[index].fallback, __ATOMIC_RELAXED) -
+                    __atomic_load_n(&mem_manager.classes[index].purged, __ATOMIC_RELAXED);
+    size_t outstanding = carved - central_free(index);
+    size_t peak = __atomic_load_n(&mem_manager.classes[index].peak, __ATOMIC_RELAXED);
+    while (outstanding > peak && outstanding <= carved &&
+           !__atomic_compare_exchange_n(&mem_manager.classes[index].peak, &peak, outstanding, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Slow path of mm_malloc: take back the blocks other threads freed, else grab a batch of blocks
+// from the central list
+static void *tcache_refill(size_t index) {
+    FreeBlock *tail;
+    size_t moved;
+    FreeBlock *head = tcache.owner ? remote_take(&remote_queues[tcache.owner], index, &tail, &moved) : NULL;
+    if (!head) {
+        class_used(index);
+        head = central_refill(index, batch_sizes[index], &tail, &moved);
+        note_demand(index);
+    }
+
+    // Keep everything but the first block in the thread cache
+    tail->next = tcache.classes[index].free_list;
+    tcache.classes[index].free_list = head->next;
+    tcache.classes[index].count += moved - 1;
+    if (tcache.classes[index].count > 2 * batch_sizes[index]) {
+        tcache_flush(&tcache, index, tcache.classes[index].count - batch_sizes[index]);
+    }
+    return (void *)head;
+}
+
+// Per-CPU mode slow path of mm_malloc: this CPU's cache is empty, take a batch from the central list
+// and refill it. The thread may move to another CPU in between, then that CPU's cache gets the batch.
+static void *percpu_refill(size_t index) {
+    FreeBlock *tail;
+    size_t moved;
+    class_used(index);
+    FreeBlock *head = central_refill(index, batch_sizes[index], &tail, &moved);
+    note_demand(index);
+
+    // Keep the first block, cache the rest; once pushed a block may be taken by another thread
+    FreeBlock *rest = head->next;
+    for (moved--; moved > 0; moved--) {
+        FreeBlock *next = rest->next;
+        if (!percpu_push(tcache.rseq, index, rest)) break;
+        rest = next;
+    }
+    if (moved) central_push(index, rest, tail, moved);
+    return head;
+}
+
+// Per-CPU mode slow path of mm_free: a full cache gives a batch back to the central list first
+static void percpu_flush(size_t index, void *ptr) {
+    while (!percpu_push(tcache.rseq, index, ptr)) {
+        FreeBlock *head = NULL, *tail = NULL, *block;
+        size_t count = 0;
+        while (count < batch_sizes[index] && (block = percpu_pop(tcache.rseq, index))) {
+            block->next = head;
+            head = block;
+            if (!tail) tail = block;
+            count++;
+        }
+        if (!count) {  // A CPU past PERCPU_MAX_CPUS has no cache
+            head = tail = (FreeBlock *)ptr;
+            count = 1;
+            ptr = NULL;
+        }
+        central_push(index, head, tail, count);
+        if (!ptr) return;
+    }
+}
+
+// Allocate a block of a chunk class: from the thread cache, then the central list, or a new slab.
+// The thread cache must be initialized.
+static inline void *class_alloc(size_t index) {
+    tcache.classes[index].allocs++;
+    FreeBlock *block = tcache.classes[index].free_list;
+    if (block) {
+        // Take from thread-local free list
+        tcache.classes[index].free_list = block->next;
+        tcache.classes[index].count--;
+        return (void *)block;
+    }
+
+    if (tcache.rseq) {
+        block = percpu_pop(tcache.rseq, index);
+        return block ? block : percpu_refill(index);
+    }
+    return tcache_refill(index);
+}
+
+// Custom malloc (allocates from the thread cache, then the central list, or carves a new slab).
+// Requests above MAX_CHUNK_SIZE are served by the page heap.
+void *mm_malloc(size_t size) {
+    if (size == 0) return NULL;  // Invalid size
+    if (size > MAX_CHUNK_SIZE) return large_alloc(size);
+    if (!tcache.initialized) tcache_init();  // Also builds the size class tables on first use
+    return class_alloc(get_chunk_index(size));
+}
+
+static inline void tcache_push(size_t index, void *ptr) {
+    if (!tcache.initialized) tcache_init();
+    if (tcache.rseq) {
+        tcache.classes[index].frees++;
+        if (!percpu_push(tcache.rseq, index, ptr)) percpu_flush(index, ptr);
+        return;
+    }
+
+    FreeBlock *block = (FreeBlock *)ptr;
+    block->next = tcache.classes[index].free_list;
+    tcache.classes[index].free_list = block;
+    tcache.classes[index].frees++;
+
+    // Keep at most two batches per class, give one back when we go over
+    if (++tcache.classes[index].count > 2 * batch_sizes[index]) {
+        tcache_flush(&tcache, index, batch_sizes[index]);
+    }
+}
+
+// A block of a slab that belongs to another thread: collect it in the outbox, which goes to the
+// owner once it holds a batch. Blocks of other owners meanwhile take the usual way, so every send
+// is a whole batch even when blocks come from many threads.
+static void remote_free(size_t owner, size_t index, void *ptr) {
+    if (!tcache.initialized) tcache_init();
+    if (tcache.outbox_owner[index] != owner) {
+        if (tcache.outbox[index]) {
+            tcache_push(index, ptr);
+            return;
+        }
+        tcache.outbox_owner[index] = owner;
+    }
+
+    FreeBlock *block = (FreeBlock *)ptr;
+    block->next = tcache.outbox[index];
+    if (!block->next) tcache.outbox_tail[index] = block;
+    tcache.outbox[index] = block;
+    tcache.classes[index].frees++;
+    if (++tcache.outbox_counts[index] >= batch_sizes[index]) outbox_send(&tcache, index);
+}
+
+// Custom free. The page map tells us the chunk class (or that it is a large allocation), and
+// which thread the block goes back to when this thread's cache is full. The cheap, predictable
+// test comes first: whether a block is ours is a coin flip in mixed workloads.
+void mm_free(void *ptr) {
+    if (!ptr) return;
+
+    size_t owner = 0;
+    size_t chunk_class = pagemap_class_owner(ptr, &owner);
+    if (!chunk_class) {
+        large_free(ptr);
+        return;
+    }
+    size_t index = chunk_class - 1;
+    if (tcache.classes[index].count >= 2 * batch_sizes[index] && owner && owner != tcache.owner) {
+        remote_free(owner, index, ptr);
+        return;
+    }
+    tcache_push(index, ptr);
+}
+
+// Free with the size passed to mm_malloc, which skips the page map lookup for small blocks, and so
+// keeps the block in this thread instead of sending it to its owner. A wrong size files the block
+// under the wrong class.
+void mm_free_sized(void *ptr, size_t size) {
+    if (!ptr) return;
+    if (size == 0 || size > MAX_CHUNK_SIZE) {
+        large_free(ptr);
+        return;
+    }
+    tcache_push(get_chunk_index(size), ptr);
+}
+
+// Allocate `n` blocks of `size` bytes into out[]. Returns how many were allocated, fewer only if
+// large allocations ran out of memory. Small blocks come off the thread cache as one sub-chain,
+// the rest off the central list with one CAS per pop.
+size_t mm_malloc_batch(size_t size, size_t n, void **out) {
+    if (size == 0) return 0;  // Invalid size
+    if (size > MAX_CHUNK_SIZE) {
+        size_t got = 0;
+        while (got < n && (out[got] = large_alloc(size))) got++;
+        return got;
+    }
+    if (!tcache.initialized) tcache_init();
+
+    size_t index = get_chunk_index(size);
+    size_t got = 0;
+    FreeBlock *block = tcache.classes[index].free_list;
+    while (got < n && block) {
+        out[got++] = block;
+        block = block->next;
+    }
+    tcache.classes[index].free_list = block;
+    tcache.classes[index].count -= got;
+
+    if (got < n) class_used(index);
+    while (got < n) {
+        FreeBlock *tail;
+        size_t moved;
+        FreeBlock *head = central_refill(index, n - got, &tail, &moved);
+        for (block = head; moved > 0; moved--, block = block->next) {
+            out[got++] = block;
+        }
+        note_demand(index);
+    }
+    tcache.classes[index].allocs += got;
+    return got;
+}
+
+// Free `n` blocks that were all allocated with `size` bytes (0: sizes unknown, look each one up).
+// NULL entries are skipped. Small blocks are linked into one chain and spliced onto the thread
+// cache, or straight onto the central list when the chain is at least a whole batch (or in per-CPU mode).
+void mm_free_batch(void **ptrs, size_t n, size_t size) {
+    if (size == 0 || size > MAX_CHUNK_SIZE) {
+        for (size_t i = 0; i < n; i++) {
+            mm_free(ptrs[i]);
+        }
+        return;
+    }
+
+    size_t index = get_chunk_index(size);
+    FreeBlock *head = NULL, *tail = NULL;
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        FreeBlock *block = (FreeBlock *)ptrs[i];
+        if (!block) continue;
+        block->next = head;
+        head = block;
+        if (!tail) tail = block;
+        count++;
+    }
+    if (!head) return;
+
+    if (!tcache.initialized) tcache_init();
+    tcache.classes[index].frees += count;
+    if (count >= batch_sizes[index] || tcache.rseq) {
+        central_push(index, head, tail, count);
+        return;
+    }
+    tail->next = tcache.classes[index].free_list;
+    tcache.classes[index].free_list = head;
+    tcache.classes[index].count += count;
+    if (tcache.classes[index].count > 2 * batch_sizes[index]) {
+        tcache_flush(&tcache, index, tcache.classes[index].count - batch_sizes[index]);
+    }
+}
+
+// Allocate `size` bytes at a multiple of `alignment`, a power of 2; NULL if it is not one. Slabs start
+// on a page and blocks sit at multiples of their chunk size from there, so up to PAGE_SIZE the smallest
+// class whose size is a multiple of `alignment` only hands out aligned blocks, and since every power of
+// 2 is a class the request is rounded up at most to one. Page runs and huge mappings are page aligned.
+// Larger alignments get a page run with the pages around the aligned part given back.
+void *mm_aligned_alloc(size_t alignment, size_t size) {
+    if (size == 0 || alignment == 0 || (alignment & (alignment - 1))) return NULL;
+    if (alignment <= PAGE_SIZE) {
+        if (size > MAX_CHUNK_SIZE) return large_alloc(size);
+        if (size < alignment) size = alignment;
+
+        mm_init();
+        size_t index = get_chunk_index(size);
+        while (chunk_sizes[index] % alignment) index++;
+        return mm_malloc(chunk_sizes[index]);
+    }
+
+    if (size > SIZE_MAX - alignment) return NULL;
+    Span *span = page_alloc_aligned((size + PAGE_SIZE - 1) / PAGE_SIZE, alignment);
+    if (!span) return NULL;
+    __atomic_fetch_add(&page_heap.large_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&page_heap.large_bytes, span->npages * PAGE_SIZE, __ATOMIC_RELAXED);
+    return span->start;
+}
+
+// The traditional name, same as mm_aligned_alloc
+void *mm_memalign(size_t alignment, size_t size) {
+    return mm_aligned_alloc(alignment, size);
+}
+
+// A pool of same-sized objects. The chunk class is resolved once, when the pool is created, instead
+// of on every allocation; MM_POOL_ALLOC and MM_POOL_FREE resolve it at compile time instead.
+// Objects are ordinary blocks of that class: they share slabs, caches, statistics and purging with
+// mm_malloc, and mm_free and mm_usable_size work on them too.
+// Since a freed object's block may next be handed out by mm_malloc, constructors and destructors
+// run on every mm_pool_alloc and mm_pool_free, not once per block.
+typedef struct {
+    size_t index;
+    size_t obj_size;
+    void (*ctor)(void *obj, void *arg);
+    void (*dtor)(void *obj, void *arg);
+    void *arg;
+} MMPool;
+
+// The class of `size` byte objects aligned to `align`: the first one that fits and whose size is a
+// multiple of the alignment, as in mm_aligned_alloc. A constant for constant arguments.
+static inline size_t pool_class(size_t size, size_t align) {
+    size_t index = size_class(size < align ? align : size);
+    while (class_size(index) % align) index++;
+    return index;
+}
+
+// Create a pool of `obj_size` byte objects aligned to `align` (a power of 2 up to PAGE_SIZE, 0 for
+// the default 8). NULL if the objects do not fit a chunk class or the alignment is not supported.
+MMPool *mm_pool_create(size_t obj_size, size_t align) {
+    if (align == 0) align = MIN_CHUNK_SIZE;
+    if (obj_size == 0 || obj_size > MAX_CHUNK_SIZE || align > PAGE_SIZE || (align & (align - 1))) return NULL;
+
+    MMPool *pool = mm_malloc(sizeof(MMPool));
+    if (!pool) return NULL;
+    *pool = (MMPool){ pool_class(obj_size, align), obj_size, NULL, NULL, NULL };
+    return pool;
+}
+
+// Run `ctor` on each object mm_pool_alloc returns and `dtor` on each one given to mm_pool_free
+// (either may be NULL), both with `arg`
+void mm_pool_set_hooks(MMPool *pool, void (*ctor)(void *, void *), void (*dtor)(void *, void *), void *arg) {
+    pool->ctor = ctor;
+    pool->dtor = dtor;
+    pool->arg = arg;
+}
+
+static inline void *pool_alloc_class(MMPool *pool, size_t index) {
+    if (!tcache.initialized) tcache_init();
+    void *obj = class_alloc(index);
+    if (pool->ctor) pool->ctor(obj, pool->arg);
+    return obj;
+}
+
+static inline void pool_free_class(MMPool *pool, size_t index, void *obj) {
+    if (!obj) return;
+    if (pool->dtor) pool->dtor(obj, pool->arg);
+    tcache_push(index, obj);
+}
+
+void *mm_pool_alloc(MMPool *pool) {
+    return pool_alloc_class(pool, pool->index);
+}
+
+// Free an object of the pool. Like mm_free_sized, it skips the page map lookup and keeps the block
+// in this thread.
+void mm_pool_free(MMPool *pool, void *obj) {
+    pool_free_class(pool, pool->index, obj);
+}
+
+// The typed forms check that the type's class is the pool's (unless built with NDEBUG), so a
+// mismatched type cannot take blocks from or give them to another class behind the pool's hooks
+static inline void *pool_alloc_typed(MMPool *pool, size_t index) {
+    assert(index == pool->index && "MM_POOL_ALLOC type does not match the pool");
+    return pool_alloc_class(pool, index);
+}
+
+static inline void pool_free_typed(MMPool *pool, size_t index, void *obj) {
+    assert(index == pool->index && "MM_POOL_FREE type does not match the pool");
+    pool_free_class(pool, index, obj);
+}
+
+// mm_pool_alloc and mm_pool_free for a pool created with mm_pool_create(sizeof(type), _Alignof(type)).
+// The class comes from sizeof(type) at the call site, so it is a constant in the inlined fast path.
+#define MM_POOL_ALLOC(pool, type) ((type *)pool_alloc_typed((pool), pool_class(sizeof(type), _Alignof(type))))
+#define MM_POOL_FREE(pool, type, obj) pool_free_typed((pool), pool_class(sizeof(type), _Alignof(type)), (obj))
+
+// Free the pool itself. Objects still allocated stay valid and can be freed with mm_free.
+void mm_pool_destroy(MMPool *pool) {
+    mm_free(pool);
+}
+
+// A region hands out memory by bumping a pointer through page runs and frees all of it at once.
+// Its chunks are large allocations, so they come from and go back to the page heap (or huge cache).
+// A region is not thread safe.
+typedef struct RegionChunk {
+    struct RegionChunk *next;
+    size_t size;
+} RegionChunk;
+
+#define REGION_ALIGN 16
+#define REGION_HEADER ((sizeof(RegionChunk) + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1))
+
+typedef struct {
+    RegionChunk *chunks;  // Newest first; the head is the one being bumped through
+    char *cur;
+    char *end;
+    size_t next_size;
+} MMRegion;
+
+MMRegion *mm_region_create(void) {
+    MMRegion *region = mm_malloc(sizeof(MMRegion));
+    if (!region) return NULL;
+    *region = (MMRegion){ NULL, NULL, NULL, REGION_MIN_CHUNK };
+    return region;
+}
+
+// Get a chunk for a request that does not fit the current one. A request bigger than a chunk gets
+// one of its own, linked behind the head so the rest of the current chunk is not wasted.
+static void *region_grow(MMRegion *region, size_t size) {
+    if (!tcache.initialized) tcache_init();
+    size_t bytes = region->next_size;
+    int dedicated = size + REGION_HEADER > bytes;
+    if (dedicated) bytes = (size + REGION_HEADER + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    RegionChunk *chunk = large_alloc(bytes);
+    if (!chunk) return NULL;
+    chunk->size = bytes;
+
+    char *ptr = (char *)chunk + REGION_HEADER;
+    if (dedicated && region->chunks) {
+        chunk->next = region->chunks->next;
+        region->chunks->next = chunk;
+        return ptr;
+    }
+    chunk->next = region->chunks;
+    region->chunks = chunk;
+    region->cur = ptr + size;
+    region->end = (char *)chunk + bytes;
+    if (!dedicated && region->next_size < REGION_MAX_CHUNK) region->next_size *= 2;
+    return ptr;
+}
+
+// `size` bytes aligned to 16, valid until the region is reset or destroyed. Never pass them to mm_free.
+void *mm_region_alloc(MMRegion *region, size_t size) {
+    if (size > SIZE_MAX / 2) return NULL;
+    if (size == 0) size = 1;  // Like mm_malloc(0): a valid pointer of its own, never NULL
+    size = (size + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1);
+    if (size <= (size_t)(region->end - region->cur)) {
+        void *ptr = region->cur;
+        region->cur += size;
+        return ptr;
+    }
+    return region_grow(region, size);
+}
+
+// Free everything allocated from the region. The newest (largest) chunk is kept for what comes next,
+// the others go back to the page heap.
+void mm_region_reset(MMRegion *region) {
+    RegionChunk *head = region->chunks;
+    if (!head) return;
+
+    for (RegionChunk *chunk = head->next, *next; chunk; chunk = next) {
+        next = chunk->next;
+        large_free(chunk);
+    }
+    head->next = NULL;
+    region->cur = (char *)head + REGION_HEADER;
+    region->end = (char *)head + head->size;
+}
+
+void mm_region_destroy(MMRegion *region) {
+    if (!region) return;
+    for (RegionChunk *chunk = region->chunks, *next; chunk; chunk = next) {
+        next = chunk->next;
+        large_free(chunk);
+    }
+    mm_free(region);
+}
+
+// Usable bytes of an allocation: its whole chunk, or up to the end of its pages
+size_t mm_usable_size(void *ptr) {
+    if (!ptr) return 0;
+
+    size_t chunk_class = pagemap_class(ptr);
+    if (chunk_class) return chunk_sizes[chunk_class - 1];
+
+    Span *span = pagemap_span(ptr);
+    return span ? (size_t)(span->start + span->npages * PAGE_SIZE - (char *)ptr) : 0;
+}
+
+// Custom realloc. A small block stays put while the new size fits its chunk and uses at least half
+// of it, large allocations grow or shrink in place when their pages allow; only then is it copied.
+void *mm_realloc(void *ptr, size_t size) {
+    if (!ptr) return mm_malloc(size);
+    if (size == 0) {
+        mm_free(ptr);
+        return NULL;
+    }
+
+    size_t old_size;
+    size_t chunk_class = pagemap_class(ptr);
+    if (chunk_class) {
+        old_size = chunk_sizes[chunk_class - 1];
+        if (size <= old_size && (size > old_size / 2 || get_chunk_index(size) == chunk_class - 1)) return ptr;
+    } else {
+        Span *span = pagemap_span(ptr);
+        if (!span || span->start != (char *)ptr) return NULL;  // Not something we handed out
+        old_size = span->npages * PAGE_SIZE;
+
+        void *resized = large_resize(span, size);
+        if (resized) return resized;
+    }
+
+    void *new_ptr = mm_malloc(size);
+    if (!new_ptr) return NULL;  // The old allocation is left alone
+    memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+    mm_free(ptr);
+    return new_ptr;
+}
+
+// Snapshot of what the allocator is doing, see mm_stats()
+typedef struct {
+    size_t chunk_size;
+    size_t allocs;        // mm_malloc calls served from this class, by all threads
+    size_t frees;
+    size_t live;          // Blocks handed out and not freed yet
+    size_t central_free;  // Blocks on the central free list
+    size_t cached_free;   // Blocks in thread caches and per-CPU caches
+    size_t remote_free;   // Blocks freed by other threads on their way back to their owner
+    size_t preallocated;  // Blocks carved by preallocate_memory()
+    size_t fallback;      // Blocks carved because the free lists ran dry...
+    size_t misses;        // ...in this many slabs
+    size_t peak;          // Most blocks in use or in thread caches at once
+    size_t purged;        // Blocks given back with their slab by the decay purger
+} MMClassStats;
+
+typedef struct {
+    MMClassStats classes[CHUNK_CLASSES];
+    size_t large_allocs;       // Allocations above MAX_CHUNK_SIZE
+    size_t large_frees;
+    size_t large_bytes;        // Pages currently held by large allocations
+    size_t arena_mapped;       // Bytes mapped for slabs and page runs, all NUMA nodes' arenas
+    size_t huge_mapped;        // Bytes mapped for huge allocations, including cached ones
+    size_t free_page_bytes;    // Bytes in free page runs...
+    size_t purged_bytes;       // ...of which were given back to the kernel
+    size_t huge_cached_bytes;  // Bytes of freed huge mappings kept for reuse
+    size_t resident;           // Resident set size of the whole process
+    size_t numa_nodes;         // NUMA nodes with their own arena
+} MMStats;
+
+static size_t resident_bytes() {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    size_t pages = 0, resident = 0;
+    if (!statm) return 0;
+    if (fscanf(statm, "%zu %zu", &pages, &resident) != 2) resident = 0;
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Fill in a snapshot of the allocator's counters. Threads count their own allocations and frees in
+// their thread cache, so the fast path pays nothing for this; the counts are added up here, which
+// makes the snapshot approximate while other threads keep allocating.
+void mm_stats(MMStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&tcache_list_lock);
+    for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+        stats->classes[i].allocs = retired_allocs[i];
+        stats->classes[i].frees = retired_frees[i];
+    }
+    for (ThreadCache *cache = tcache_list; cache; cache = cache->next) {
+        for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+            stats->classes[i].allocs += __atomic_load_n(&cache->classes[i].allocs, __ATOMIC_RELAXED);
+            stats->classes[i].frees += __atomic_load_n(&cache->classes[i].frees, __ATOMIC_RELAXED);
+            stats->classes[i].cached_free += __atomic_load_n(&cache->classes[i].count, __ATOMIC_RELAXED);
+            stats->classes[i].remote_free += __atomic_load_n(&cache->outbox_counts[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&tcache_list_lock);
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    for (long cpu = 0; percpu_caches && cpu < cpus && cpu < PERCPU_MAX_CPUS; cpu++) {
+        for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+            stats->classes[i].cached_free += __atomic_load_n(&percpu_caches[cpu].counts[i], __ATOMIC_RELAXED);
+        }
+    }
+    for (size_t owner = 1; owner <= REMOTE_OWNERS; owner++) {
+        for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+            stats->classes[i].remote_free += __atomic_load_n(&remote_queues[owner].counts[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+        MMClassStats *cls = &stats->classes[i];
+        cls->chunk_size = chunk_sizes[i];
+        cls->live = cls->allocs - cls->frees;
+        cls->central_free = central_free(i);
+        cls->preallocated = __atomic_load_n(&mem_manager.classes[i].preallocated, __ATOMIC_RELAXED);
+        cls->fallback = __atomic_load_n(&mem_manager.classes[i].fallback, __ATOMIC_RELAXED);
+        cls->misses = __atomic_load_n(&mem_manager.classes[i].misses, __ATOMIC_RELAXED);
+        cls->peak = __atomic_load_n(&mem_manager.classes[i].peak, __ATOMIC_RELAXED);
+        cls->purged = __atomic_load_n(&mem_manager.classes[i].purged, __ATOMIC_RELAXED);
+    }
+
+    stats->large_allocs = __atomic_load_n(&page_heap.large_allocs, __ATOMIC_RELAXED);
+    stats->large_frees = __atomic_load_n(&page_heap.large_frees, __ATOMIC_RELAXED);
+    stats->large_bytes = __atomic_load_n(&page_heap.large_bytes, __ATOMIC_RELAXED);
+    stats->huge_mapped = __atomic_load_n(&page_heap.huge_mapped_bytes, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&page_heap.lock);
+    stats->free_page_bytes = page_heap.free_bytes;
+    stats->purged_bytes = page_heap.purged_bytes;
+    stats->huge_cached_bytes = page_heap.huge_cached_bytes;
+    pthread_mutex_unlock(&page_heap.lock);
+
+    for (size_t node = 0; node < MM_MAX_NODES; node++) {
+        pthread_mutex_lock(&arenas[node].lock);
+        stats->arena_mapped += arenas[node].mapped;
+        pthread_mutex_unlock(&arenas[node].lock);
+    }
+    stats->numa_nodes = mm_numa_nodes;
+
+    stats->resident = resident_bytes();
+}
+
+// Write a snapshot as one JSON object, classes without any activity are left out
+void mm_stats_json(const MMStats *stats, FILE *out) {
+    fprintf(out, "{\"large_allocs\": %zu, \"large_frees\": %zu, \"large_bytes\": %zu, "
+                 "\"arena_mapped\": %zu, \"huge_mapped\": %zu, \"free_page_bytes\": %zu, "
+                 "\"purged_bytes\": %zu, \"huge_cached_bytes\": %zu, \"resident\": %zu, \"numa_nodes\": %zu, "
+                 "\"classes\": [",
+            stats->large_allocs, stats->large_frees, stats->large_bytes, stats->arena_mapped, stats->huge_mapped,
+            stats->free_page_bytes, stats->purged_bytes, stats->huge_cached_bytes, stats->resident, stats->numa_nodes);
+
+    const char *separator = "";
+    for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+        const MMClassStats *cls = &stats->classes[i];
+        if (!cls->allocs && !cls->preallocated && !cls->fallback) continue;
+        fprintf(out, "%s\n  {\"chunk_size\": %zu, \"allocs\": %zu, \"frees\": %zu, \"live\": %zu, "
+                     "\"central_free\": %zu, \"cached_free\": %zu, \"remote_free\": %zu, \"preallocated\": %zu, "
+                     "\"fallback\": %zu, \"misses\": %zu, \"peak\": %zu, \"purged\": %zu}",
+                separator, cls->chunk_size, cls->allocs, cls->frees, cls->live, cls->central_free, cls->cached_free,
+                cls->remote_free, cls->preallocated, cls->fallback, cls->misses, cls->peak, cls->purged);
+        separator = ",";
+    }
+    fprintf(out, "\n]}\n");
+}
+
+// Preallocation profile: a text file with one line per chunk class that was used,
+// "<chunk size> <peak blocks> <allocations>", written by mm_profile_save() at the end of a run
+// and read by preallocate_profile() at the start of the next one.
+int mm_profile_save(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) return -1;
+
+    MMStats stats;
+    mm_stats(&stats);
+    fprintf(out, "# chunk_size peak_blocks allocs\n");
+    for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+        if (stats.classes[i].peak || stats.classes[i].allocs) {
+            fprintf(out, "%zu %zu %zu\n", stats.classes[i].chunk_size, stats.classes[i].peak, stats.classes[i].allocs);
+        }
+    }
+    return fclose(out) ? -1 : 0;
+}
+
+// Preallocate what each class needed at its peak in the profiled run, scaled down to fit
+// `total_memory` bytes (0: no limit). Returns the bytes preallocated, 0 if there is no usable profile.
+size_t preallocate_profile(const char *path, size_t total_memory) {
+    FILE *in = fopen(path, "r");
+    if (!in) return 0;
+
+    mm_init();
+    size_t counts[CHUNK_CLASSES] = {0};
+    size_t bytes = 0;
+    char line[128];
+    while (fgets(line, sizeof(line), in)) {
+        size_t chunk_size, peak, allocs;
+        if (sscanf(line, "%zu %zu %zu", &chunk_size, &peak, &allocs) != 3) continue;
+        if (chunk_size == 0 || chunk_size > MAX_CHUNK_SIZE) continue;
+
+        size_t index = get_chunk_index(chunk_size);  // Still the right class if the table changed
+        counts[index] += peak;
+        bytes += peak * chunk_sizes[index];
+    }
+    fclose(in);
+
+    if (total_memory && bytes > total_memory) {
+        double scale = (double)total_memory / bytes;
+        bytes = 0;
+        for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+            counts[i] = (size_t)(counts[i] * scale);
+            bytes += counts[i] * chunk_sizes[i];
+        }
+    }
+    preallocate_counts(counts);
+    return bytes;
+}
+
+// Binary trace format written by the shim's MM_TRACE capture and read back by replay (-T): a
+// TraceHeader followed by TraceRecords, in per-thread order but not sorted across threads.
+// Records carry pointers; the reader turns them back into allocation ids.
+#define TRACE_MAGIC "MMTRACE1"
+
+enum {
+    TRACE_MALLOC,        // ptr was returned, size bytes
+    TRACE_FREE,          // ptr is about to be freed
+    TRACE_REALLOC_FROM,  // ptr is about to be resized; the thread's next record says where it went
+    TRACE_REALLOC,       // The resize of the previous TRACE_REALLOC_FROM returned ptr, size bytes
+};
+
+typedef struct {
+    char magic[8];
+    uint64_t ticks_per_sec;  // Timestamp frequency
+    uint64_t dropped;        // Records lost to full rings, filled in when the capture ends
+} TraceHeader;
+
+typedef struct {
+    uint64_t timestamp;
+    uint64_t ptr;
+    uint64_t size : 48;
+    uint64_t thread : 14;  // Capture thread number, reused after a thread exits
+    uint64_t op : 2;
+} TraceRecord;
+
+#ifdef MM_PRELOAD
+////////////// LD_PRELOAD shim
+// Built with -DMM_PRELOAD -shared -fPIC -fvisibility=hidden into libmm.so, which replaces the libc
+// allocator of any program run with LD_PRELOAD=./libmm.so. Only these entry points are exported.
+#define MM_EXPORT __attribute__((visibility("default")))
+
+// MM_TRACE=<file> captures every allocation the program makes, for replay with -T (%p in the name
+// becomes the pid, for programs that run others). Each thread appends records to its own ring and a
+// writer thread drains the rings every TRACE_FLUSH_MS, or sooner when one fills up, so tracing takes
+// no lock on the allocation path. A full ring drops records rather than stall the program. Frees are
+// stamped before the memory is released and allocations after they return, so a reused address
+// always sorts after its previous free.
+#define TRACE_RING_SIZE (1 << 17)  // Records per thread (power of 2), 3 MiB
+#define TRACE_WAKE_EVERY (TRACE_RING_SIZE / 4)  // Records between early wakeups of the writer
+#define TRACE_FLUSH_MS 10
+
+typedef struct TraceRing {
+    TraceRecord records[TRACE_RING_SIZE];
+    size_t head __attribute__((aligned(64)));  // Written by the owning thread
+    size_t tail __attribute__((aligned(64)));  // Written by the writer thread
+    int exited;                                // Owner is gone: reusable once drained
+    uint32_t thread;
+    struct TraceRing *next;
+} TraceRing;
+
+static int trace_enabled;
+static int trace_stopping;
+static int trace_fd = -1;
+static uint64_t trace_dropped;
+static uint64_t trace_start_ticks, trace_start_ns;
+static uint32_t trace_threads;
+static TraceRing *trace_rings;   // Never unmapped, reused by later threads
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;  // Only used so thread exit releases the ring
+static pthread_t trace_writer_thread;
+static pthread_mutex_t trace_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_wake;  // Wakes the writer early, and at exit
+static __thread TraceRing *trace_ring __attribute__((tls_model("initial-exec")));
+static __thread int trace_attaching __attribute__((tls_model("initial-exec")));
+
+static void trace_thread_exit(void *arg) {
+    TraceRing *ring = (TraceRing *)arg;
+    trace_ring = NULL;
+    __atomic_store_n(&ring->exited, 1, __ATOMIC_RELEASE);
+}
+
+static TraceRing *trace_ring_attach(void) {
+    trace_attaching = 1;  // pthread_setspecific may allocate
+    pthread_mutex_lock(&trace_lock);
+    TraceRing *ring = trace_rings;
+    while (ring && !(__atomic_load_n(&ring->exited, __ATOMIC_ACQUIRE) && ring->tail == ring->head)) ring = ring->next;
+    if (ring) {
+        ring->exited = 0;
+    } else if ((ring = map_region(sizeof(TraceRing)))) {
+        ring->thread = trace_threads++;
+        ring->next = trace_rings;
+        trace_rings = ring;
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    if (ring) pthread_setspecific(trace_key, ring);
+    trace_ring = ring;
+    trace_attaching = 0;
+    return ring;
+}
+
+static void trace_record(int op, const void *ptr, size_t size, uint64_t ticks) {
+    TraceRing *ring = trace_ring;
+    if (!ring && (trace_attaching || !(ring = trace_ring_attach()))) return;
+
+    size_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE) {
+        __atomic_fetch_add(&trace_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    TraceRecord *record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    record->timestamp = ticks;
+    record->ptr = (uintptr_t)ptr;
+    record->size = size;
+    record->thread = ring->thread;
+    record->op = op;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    if ((head + 1) % TRACE_WAKE_EVERY == 0) pthread_cond_signal(&trace_wake);
+}
+
+static void trace_write(const void *data, size_t size) {
+    while (size) {
+        ssize_t written = write(trace_fd, data, size);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return;
+        data = (const char *)data + written;
+        size -= written;
+    }
+}
+
+// Write out everything the rings hold, one contiguous piece of a ring at a time
+static void trace_drain(void) {
+    pthread_mutex_lock(&trace_lock);
+    for (TraceRing *ring = trace_rings; ring; ring = ring->next) {
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        size_t tail = ring->tail;
+        while (tail != head) {
+            size_t start = tail & (TRACE_RING_SIZE - 1);
+            size_t count = head - tail;
+            if (count > TRACE_RING_SIZE - start) count = TRACE_RING_SIZE - start;
+            trace_write(&ring->records[start], count * sizeof(TraceRecord));
+            tail += count;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void *trace_writer(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&trace_wake_lock);
+    while (!trace_stopping) {
+        uint64_t wake = monotonic_ns() + TRACE_FLUSH_MS * 1000000;
+        struct timespec deadline = { wake / 1000000000, wake % 1000000000 };
+        pthread_cond_timedwait(&trace_wake, &trace_wake_lock, &deadline);
+        pthread_mutex_unlock(&trace_wake_lock);
+        trace_drain();
+        pthread_mutex_lock(&trace_wake_lock);
+    }
+    pthread_mutex_unlock(&trace_wake_lock);
+    return NULL;
+}
+
+// At exit: write what is left and fill in the header
+static void trace_stop(void) {
+    if (!trace_enabled) return;  // A forked child: the parent owns the file
+    trace_enabled = 0;
+    pthread_mutex_lock(&trace_wake_lock);
+    trace_stopping = 1;
+    pthread_cond_signal(&trace_wake);
+    pthread_mutex_unlock(&trace_wake_lock);
+    pthread_join(trace_writer_thread, NULL);
+    trace_drain();
+
+    TraceHeader header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    uint64_t ns = monotonic_ns() - trace_start_ns;
+    header.ticks_per_sec = ns ? (uint64_t)((double)(cpu_ticks() - trace_start_ticks) * 1e9 / ns) : 0;
+    header.dropped = __atomic_load_n(&trace_dropped, __ATOMIC_RELAXED);
+    pwrite(trace_fd, &header, sizeof(header), 0);
+    close(trace_fd);
+}
+
+// The child of a fork() has no writer thread and must not write to the parent's file
+static void trace_postfork_child(void) {
+    trace_enabled = 0;
+}
+
+static void trace_start(const char *pattern) {
+    char path[4096];
+    size_t n = 0;
+    for (const char *c = pattern; *c && n < sizeof(path) - 24; c++) {
+        if (c[0] == '%' && c[1] == 'p') {
+            n += sprintf(path + n, "%d", (int)getpid());
+            c++;
+        } else {
+            path[n++] = *c;
+        }
+    }
+    path[n] = '\0';
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd < 0) return;
+    TraceHeader header = {0};  // Rewritten by trace_stop
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    trace_write(&header, sizeof(header));
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);  // trace_writer's deadlines come from monotonic_ns()
+    pthread_cond_init(&trace_wake, &attr);
+    pthread_key_create(&trace_key, trace_thread_exit);
+    pthread_atfork(NULL, NULL, trace_postfork_child);
+    trace_start_ns = monotonic_ns();
+    trace_start_ticks = cpu_ticks();
+    trace_enabled = 1;
+    if (pthread_create(&trace_writer_thread, NULL, trace_writer, NULL) != 0) {
+        trace_enabled = 0;
+        close(trace_fd);
+        return;
+    }
+    atexit(trace_stop);
+}
+
+MM_EXPORT void *malloc(size_t size) {
+    void *ptr = mm_malloc(size ? size : 1);  // malloc(0) must return a unique pointer
+    if (!ptr) errno = ENOMEM;
+    else if (trace_enabled) trace_record(TRACE_MALLOC, ptr, size, cpu_ticks());
+    return ptr;
+}
+
+MM_EXPORT void free(void *ptr) {
+    if (trace_enabled && ptr) trace_record(TRACE_FREE, ptr, 0, cpu_ticks());
+    mm_free(ptr);
+}
+
+MM_EXPORT void *calloc(size_t count, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    // Not malloc(): gcc turns malloc + memset back into a call to calloc
+    void *ptr = mm_malloc(total ? total : 1);
+    if (ptr) {
+        memset(ptr, 0, total);  // Recycled blocks are not zeroed
+        if (trace_enabled) trace_record(TRACE_MALLOC, ptr, total, cpu_ticks());
+    } else {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+MM_EXPORT void *realloc(void *ptr, size_t size) {
+    int traced = trace_enabled && ptr;  // realloc(NULL, size) is traced as a malloc
+    if (traced) trace_record(TRACE_REALLOC_FROM, ptr, 0, cpu_ticks());
+    void *new_ptr = mm_realloc(ptr, size);
+    if (!new_ptr && size) errno = ENOMEM;
+    if (traced) {
+        // realloc(ptr, 0) freed ptr; a failed resize left it where it was
+        trace_record(TRACE_REALLOC, new_ptr || !size ? new_ptr : ptr, size, cpu_ticks());
+    } else if (trace_enabled && new_ptr) {
+        trace_record(TRACE_MALLOC, new_ptr, size, cpu_ticks());
+    }
+    return new_ptr;
+}
+
+MM_EXPORT int posix_memalign(void **out, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1))) return EINVAL;
+    void *ptr = mm_aligned_alloc(alignment, size ? size : 1);
+    if (!ptr) return ENOMEM;
+    if (trace_enabled) trace_record(TRACE_MALLOC, ptr, size, cpu_ticks());
+    *out = ptr;
+    return 0;
+}
+
+MM_EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    void *ptr = mm_aligned_alloc(alignment, size ? size : 1);
+    if (!ptr) errno = ENOMEM;
+    else if (trace_enabled) trace_record(TRACE_MALLOC, ptr, size, cpu_ticks());
+    return ptr;
+}
+
+MM_EXPORT void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+MM_EXPORT size_t malloc_usable_size(void *ptr) {
+    return mm_usable_size(ptr);
+}
+
+// MM_STATS=<file> writes an mm_stats() snapshot as JSON when the program exits
+static void shim_write_stats(void) {
+    FILE *out = fopen(getenv("MM_STATS"), "w");
+    if (!out) return;
+
+    MMStats stats;
+    mm_stats(&stats);
+    mm_stats_json(&stats, out);
+    fclose(out);
+}
+
+static void shim_save_profile(void) {
+    mm_profile_save(getenv("MM_PROFILE"));
+}
+
+// MM_DECAY_MS=<ms> turns on the decay purger for the preloaded program.
+// MM_PROFILE=<file> preallocates from the profile if it exists and saves a new one at exit.
+__attribute__((constructor)) static void shim_init(void) {
+    if (getenv("MM_TRACE")) trace_start(getenv("MM_TRACE"));
+    const char *decay = getenv("MM_DECAY_MS");
+    if (decay && atol(decay) > 0) mm_set_decay(atol(decay));
+    if (getenv("MM_STATS")) atexit(shim_write_stats);
+    if (getenv("MM_PROFILE")) {
+        preallocate_profile(getenv("MM_PROFILE"), 0);
+        atexit(shim_save_profile);
+    }
+}
+////////////// End LD_PRELOAD shim
+#else
+
+// Generate a list of random sizes summing up to approximately `total_size`
+// Sizes are spread evenly over the power-of-2 ranges (4, 8], (8, 16], ..., (32768, 65536]
+size_t generate_random_sizes(size_t total_size, size_t *sizes, size_t max_count,
+                             size_t *requested_counts, size_t *requested_bytes) {
+    size_t num_sizes = 0;
+    size_t used_memory = 0;
+    srand(time(NULL));  // Seed random generator
+
+    while (used_memory < total_size && num_sizes < max_count) {
+        size_t range = (size_t)MIN_CHUNK_SIZE << (rand() % 14);
+        size_t size = range / 2 + 1 + rand() % (range / 2);
+
+        if (used_memory + size > total_size) break;  // Stop if we exceed the limit
+
+        size_t index = get_chunk_index(size);
+        sizes[num_sizes++] = size;
+        used_memory += size;
+        requested_counts[index]++;  // Track requested sizes
+        requested_bytes[index] += size;
+    }
+
+    return num_sizes;  // Return actual number of allocations
+}
+
+// Debugging: Print memory usage statistics
+// Internal fragmentation is the part of each handed out chunk that the request did not use
+// Misses are the times a class ran dry and had to carve a slab: a prefill that fits the demand has none
+void print_memory_stats(size_t *requested_counts, size_t *requested_bytes) {
+    size_t total_chunk_bytes = 0, total_requested_bytes = 0;
+    MMStats stats;
+    mm_stats(&stats);
+
+    printf("\nMemory Statistics:\n");
+    printf("%-10s %-15s %-15s %-15s %-15s\n", "Chunk Size", "Preallocated", "Requested", "Misses", "Fragmentation");
+    
+    for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+        size_t chunk_bytes = requested_counts[i] * chunk_sizes[i];
+        double waste = chunk_bytes ? 100.0 * (chunk_bytes - requested_bytes[i]) / chunk_bytes : 0.0;
+        printf("%-10zu %-15zu %-15zu %-15zu %.1f%%\n", chunk_sizes[i], stats.classes[i].preallocated, requested_counts[i],
+               stats.classes[i].misses, waste);
+
+        total_chunk_bytes += chunk_bytes;
+        total_requested_bytes += requested_bytes[i];
+    }
+    printf("Requested %zu bytes in %zu bytes of chunks, %.1f%% internal fragmentation\n",
+           total_requested_bytes, total_chunk_bytes,
+           total_chunk_bytes ? 100.0 * (total_chunk_bytes - total_requested_bytes) / total_chunk_bytes : 0.0);
+
+    // What the allocator itself reports
+    size_t allocs = 0, fallback = 0;
+    for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+        allocs += stats.classes[i].allocs;
+        fallback += stats.classes[i].fallback;
+    }
+    printf("Allocator: %zu small + %zu large allocations, %zu blocks carved on demand, %zu MB mapped, %zu MB resident\n",
+           allocs, stats.large_allocs, fallback, (stats.arena_mapped + stats.huge_mapped) >> 20, stats.resident >> 20);
+}
+
+#define FREE_ROUNDS 500  // Repetitions when comparing size-less and sized mm_free
+
+#define BATCH_ROUNDS 20000  // Repetitions when comparing batched and per-call allocation
+#define BATCH_NODES 64      // Nodes allocated and freed together
+
+static const size_t batch_node_sizes[] = { 48, 256, 4096 };
+
+static void batch_throughput(size_t size) {
+    void *nodes[BATCH_NODES];
+
+    clock_t start = clock();
+    for (size_t round = 0; round < BATCH_ROUNDS; round++) {
+        for (size_t i = 0; i < BATCH_NODES; i++) {
+            nodes[i] = mm_malloc(size);
+        }
+        for (size_t i = 0; i < BATCH_NODES; i++) {
+            mm_free(nodes[i]);
+        }
+    }
+    clock_t end = clock();
+    double single_time = (double)(end - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (size_t round = 0; round < BATCH_ROUNDS; round++) {
+        mm_malloc_batch(size, BATCH_NODES, nodes);
+        mm_free_batch(nodes, BATCH_NODES, size);
+    }
+    end = clock();
+    double batch_time = (double)(end - start) / CLOCKS_PER_SEC;
+
+    double ops = 2.0 * BATCH_ROUNDS * BATCH_NODES;
+    printf("%d x %d nodes of %zu bytes: per-call %lf sec (%.0f ops/sec), batched %lf sec (%.0f ops/sec)\n",
+           BATCH_ROUNDS, BATCH_NODES, size, single_time, ops / single_time, batch_time, ops / batch_time);
+}
+
+// Per-operation latency: every malloc and free of the benchmark's sizes is timed on its own with
+// cpu_ticks() into HDR-style histograms, LATENCY_SUB_BUCKETS log-spaced buckets per power of 2, so a
+// value is kept to within 1/LATENCY_SUB_BUCKETS of itself however large it gets.
+#define LATENCY_ROUNDS 100  // Passes over the benchmark's sizes
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} LatencyHistogram;
+
+static size_t latency_bucket(uint64_t value) {
+    if (value < LATENCY_SUB_BUCKETS) return value;
+    int shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS + (value >> shift) - LATENCY_SUB_BUCKETS;
+}
+
+// Lowest value that lands in `bucket`
+static uint64_t latency_bucket_value(size_t bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) return bucket;
+    size_t shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    return (uint64_t)(bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS) << shift;
+}
+
+static void latency_record(LatencyHistogram *histogram, uint64_t value) {
+    histogram->counts[latency_bucket(value)]++;
+    histogram->total++;
+    if (value > histogram->max) histogram->max = value;
+}
+
+static void latency_merge(LatencyHistogram *into, const LatencyHistogram *from) {
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    if (from->max > into->max) into->max = from->max;
+}
+
+static uint64_t latency_percentile(const LatencyHistogram *histogram, double percentile) {
+    uint64_t rank = (uint64_t)(histogram->total * percentile / 100.0);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen > rank) {
+            uint64_t value = latency_bucket_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+// Cost of reading the clock twice back to back, taken off every sample
+static uint64_t timer_overhead(void) {
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 10000; i++) {
+        uint64_t start = cpu_ticks();
+        uint64_t end = cpu_ticks();
+        if (end - start < best) best = end - start;
+    }
+    return best;
+}
+
+static double ticks_per_ns(void) {
+    uint64_t start_ns = monotonic_ns(), start = cpu_ticks();
+    while (monotonic_ns() - start_ns < 20000000);  // 20 ms
+    return (double)(cpu_ticks() - start) / (monotonic_ns() - start_ns);
+}
+
+// Nanoseconds for a fixed chain of dependent multiplies. The TSC runs at a constant rate whatever
+// the core clock does, so if this changes between two calls the CPU frequency changed in between.
+static uint64_t spin_ns(void) {
+    uint64_t best = UINT64_MAX;
+    for (int attempt = 0; attempt < 3; attempt++) {
+        uint64_t x = 1, start = monotonic_ns();
+        for (int i = 0; i < 10000000; i++) {
+            x = x * 6364136223846793005ULL + 1;
+            __asm__ volatile("" : "+r"(x));
+        }
+        uint64_t elapsed = monotonic_ns() - start;
+        if (elapsed < best) best = elapsed;
+    }
+    return best;
+}
+
+// Anything but the performance governor lets the clock move under the benchmark
+static void check_cpu_governor(void) {
+    char governor[64] = "";
+    FILE *in = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor", "r");
+    if (!in) return;  // No cpufreq: nothing scales the clock, or we cannot tell
+    if (fgets(governor, sizeof(governor), in)) governor[strcspn(governor, "\n")] = '\0';
+    fclose(in);
+    if (strcmp(governor, "performance") != 0) {
+        printf("Warning: CPU frequency scaling is on (governor \"%s\"), latencies may vary between runs\n", governor);
+    }
+}
+
+static void latency_run(void *(*alloc)(size_t), void (*release)(void *), const size_t *sizes, size_t count,
+                        void **ptrs, uint64_t overhead, LatencyHistogram *mallocs, LatencyHistogram *frees) {
+    for (size_t round = 0; round < LATENCY_ROUNDS; round++) {
+        for (size_t i = 0; i < count; i++) {
+            uint64_t start = cpu_ticks();
+            ptrs[i] = alloc(sizes[i]);
+            uint64_t end = cpu_ticks();
+            latency_record(&mallocs[get_chunk_index(sizes[i])], end - start > overhead ? end - start - overhead : 0);
+        }
+        for (size_t i = 0; i < count; i++) {
+            uint64_t start = cpu_ticks();
+            release(ptrs[i]);
+            uint64_t end = cpu_ticks();
+            latency_record(&frees[get_chunk_index(sizes[i])], end - start > overhead ? end - start - overhead : 0);
+        }
+    }
+}
+
+static void print_latency_row(const char *label, const char *op, const LatencyHistogram *histograms[2], double scale) {
+    printf("%-10s %-6s", label, op);
+    for (int a = 0; a < 2; a++) {
+        const LatencyHistogram *histogram = histograms[a];
+        printf("  %6.0f %6.0f %7.0f %9.0f", latency_percentile(histogram, 50) / scale,
+               latency_percentile(histogram, 99) / scale, latency_percentile(histogram, 99.9) / scale,
+               histogram->max / scale);
+    }
+    printf("\n");
+}
+
+// malloc against mm_malloc, one row per class and operation, in ns
+static void benchmark_latency(const size_t *sizes, size_t count, void **ptrs) {
+    LatencyHistogram *histograms = calloc(2 * 2 * (CHUNK_CLASSES + 1), sizeof(LatencyHistogram));
+    if (!histograms) return;
+    // [allocator][op][class], class CHUNK_CLASSES being all of them together
+    #define LATENCY_AT(a, op, c) (&histograms[((a) * 2 + (op)) * (CHUNK_CLASSES + 1) + (c)])
+
+    check_cpu_governor();
+    double scale = ticks_per_ns();
+    uint64_t overhead = timer_overhead();
+    uint64_t spin_before = spin_ns();
+
+    latency_run(malloc, free, sizes, count, ptrs, overhead, LATENCY_AT(0, 0, 0), LATENCY_AT(0, 1, 0));
+    latency_run(mm_malloc, mm_free, sizes, count, ptrs, overhead, LATENCY_AT(1, 0, 0), LATENCY_AT(1, 1, 0));
+
+    uint64_t spin_after = spin_ns();
+    double drift = (double)spin_after / spin_before;
+    if (drift > 1.05 || drift < 0.95) {
+        printf("Warning: the CPU clock changed during the latency run (a fixed loop took %.1f%% %s), "
+               "pin the frequency for stable numbers\n", 100.0 * (drift > 1 ? drift - 1 : 1 - drift),
+               drift > 1 ? "longer" : "less");
+    }
+
+    printf("Per-operation latency in ns, %d rounds, %.1f ns timer overhead taken off each sample:\n",
+           LATENCY_ROUNDS, overhead / scale);
+    printf("%-10s %-6s  %-31s  %-31s\n", "", "", "----------- malloc ------------", "---------- mm_malloc ----------");
+    printf("%-10s %-6s", "Chunk Size", "Op");
+    for (int a = 0; a < 2; a++) printf("  %6s %6s %7s %9s", "p50", "p99", "p99.9", "max");
+    printf("\n");
+
+    static const char *ops[2] = { "malloc", "free" };
+    for (size_t c = 0; c <= CHUNK_CLASSES; c++) {
+        char label[16];
+        if (c < CHUNK_CLASSES) {
+            if (LATENCY_AT(0, 0, c)->total == 0) continue;
+            snprintf(label, sizeof(label), "%zu", chunk_sizes[c]);
+        } else {
+            snprintf(label, sizeof(label), "All");
+            for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+                for (int a = 0; a < 2; a++) {
+                    latency_merge(LATENCY_AT(a, 0, CHUNK_CLASSES), LATENCY_AT(a, 0, i));
+                    latency_merge(LATENCY_AT(a, 1, CHUNK_CLASSES), LATENCY_AT(a, 1, i));
+                }
+            }
+        }
+        for (int op = 0; op < 2; op++) {
+            const LatencyHistogram *row[2] = { LATENCY_AT(0, op, c), LATENCY_AT(1, op, c) };
+            print_latency_row(label, ops[op], row, scale);
+        }
+    }
+    #undef LATENCY_AT
+    free(histograms);
+}
+
+static const char *profile_path;  // -P: preallocate from this demand profile and save a new one
+
+// Benchmark function
+void benchmark(size_t total_memory) {
+    const size_t max_allocations = 100000;
+    size_t *sizes = malloc(max_allocations * sizeof(size_t));
+    void **ptrs = malloc(max_allocations * sizeof(void *));
+    size_t requested_counts[CHUNK_CLASSES] = {0};  // Track actual requested sizes
+    size_t requested_bytes[CHUNK_CLASSES] = {0};
+    
+    if (!sizes || !ptrs) {
+        printf("Memory allocation failed for benchmark setup.\n");
+        return;
+    }
+
+    mm_init();  // Size class tables are needed to bucket the requests
+    size_t num_allocations = generate_random_sizes(total_memory, sizes, max_allocations,
+                                                   requested_counts, requested_bytes);
+
+    printf("Benchmarking with %zu allocations totaling ~%zu bytes...\n", num_allocations, total_memory);
+
+    // **Standard malloc/free benchmark**
+    clock_t start = clock();
+    for (size_t i = 0; i < num_allocations; i++) {
+        ptrs[i] = malloc(sizes[i]);
+    }
+    for (size_t i = 0; i < num_allocations; i++) {
+        free(ptrs[i]);
+    }
+    clock_t end = clock();
+    printf("Standard malloc/free: %lf sec\n", (double)(end - start) / CLOCKS_PER_SEC);
+
+    // **Custom mm_malloc/mm_free benchmark (Preallocated)**
+    // Allocate memory for our allocator before benchmarking, following the demand profile if there is one
+    size_t profiled = profile_path ? preallocate_profile(profile_path, total_memory * 2) : 0;
+    if (profiled) {
+        printf("Preallocated %zu bytes of memory following the demand profile in %s.\n", profiled, profile_path);
+    } else {
+        preallocate_memory(total_memory);
+    }
+
+    // Some options here to sleep before we do the memory manager test, in an attempt to play with caching
+    //sleep(1);
+    for (volatile int i = 0; i < 1000000000; i++);  // Waste CPU cycles instead of sleeping
+
+    start = clock();
+    for (size_t i = 0; i < num_allocations; i++) {
+        ptrs[i] = mm_malloc(sizes[i]);
+    }
+    for (size_t i = 0; i < num_allocations; i++) {
+        mm_free(ptrs[i]);
+    }
+    end = clock();
+    printf("Custom mm_malloc/mm_free: %lf sec\n", (double)(end - start) / CLOCKS_PER_SEC);
+
+    // **Per-operation latency**: the totals above are CPU time for whole loops and hide the tail
+    benchmark_latency(sizes, num_allocations, ptrs);
+
+    // **Size-less mm_free (page map lookup) vs mm_free_sized**, repeated so the difference is measurable
+    double free_times[2];
+    for (int sized = 0; sized < 2; sized++) {
+        start = clock();
+        for (size_t round = 0; round < FREE_ROUNDS; round++) {
+            for (size_t i = 0; i < num_allocations; i++) {
+                ptrs[i] = mm_malloc(sizes[i]);
+            }
+            for (size_t i = 0; i < num_allocations; i++) {
+                if (sized) {
+                    mm_free_sized(ptrs[i], sizes[i]);
+                } else {
+                    mm_free(ptrs[i]);
+                }
+            }
+        }
+        end = clock();
+        free_times[sized] = (double)(end - start) / CLOCKS_PER_SEC;
+    }
+    printf("%d rounds of mm_malloc + mm_free: %lf sec, + mm_free_sized: %lf sec (%.2f ns/free for the page map lookup)\n",
+           FREE_ROUNDS, free_times[0], free_times[1],
+           (free_times[0] - free_times[1]) * 1e9 / ((double)FREE_ROUNDS * num_allocations));
+
+    // **Batched vs per-call mm_malloc/mm_free**, same-sized nodes allocated and freed together
+    for (size_t b = 0; b < sizeof(batch_node_sizes) / sizeof(batch_node_sizes[0]); b++) {
+        batch_throughput(batch_node_sizes[b]);
+    }
+
+    // Print memory allocation statistics
+    print_memory_stats(requested_counts, requested_bytes);
+
+    if (profile_path && mm_profile_save(profile_path) == 0) {
+        printf("Saved the demand profile to %s, the next run with -P preallocates from it.\n", profile_path);
+    }
+
+    free(sizes);
+    free(ptrs);
+}
+
+// Large allocation benchmark: keep a small window of live buffers above MAX_CHUNK_SIZE and replace
+// them at random, touching each buffer like a caller would. Shows the cost of going back to the kernel.
+#define LARGE_ITERATIONS 20000
+#define LARGE_LIVE 8
+
+static void large_churn(void *(*alloc)(size_t), void (*release)(void *), const size_t *sizes) {
+    void *live[LARGE_LIVE] = {NULL};
+
+    for (size_t i = 0; i < LARGE_ITERATIONS; i++) {
+        size_t slot = i % LARGE_LIVE;
+        if (live[slot]) release(live[slot]);
+
+        live[slot] = alloc(sizes[i]);
+        ((char *)live[slot])[0] = 1;
+        ((char *)live[slot])[sizes[i] - 1] = 1;
+    }
+    for (size_t slot = 0; slot < LARGE_LIVE; slot++) {
+        if (live[slot]) release(live[slot]);
+    }
+}
+
+void benchmark_large() {
+    size_t *sizes = malloc(LARGE_ITERATIONS * sizeof(size_t));
+    srand(time(NULL));
+    for (size_t i = 0; i < LARGE_ITERATIONS; i++) {
+        // Spread evenly over the power-of-2 ranges above MAX_CHUNK_SIZE up to 16MB
+        size_t range = (size_t)MAX_CHUNK_SIZE << (1 + rand() % 8);
+        sizes[i] = range / 2 + 1 + rand() % (range / 2);
+    }
+
+    printf("Benchmarking %d large allocations (64KB - 16MB, %d live at a time)...\n", LARGE_ITERATIONS, LARGE_LIVE);
+
+    clock_t start = clock();
+    large_churn(malloc, free, sizes);
+    clock_t end = clock();
+    printf("Standard malloc/free: %lf sec\n", (double)(end - start) / CLOCKS_PER_SEC);
+
+    start = clock();
+    large_churn(mm_malloc, mm_free, sizes);
+    end = clock();
+    printf("Custom mm_malloc/mm_free: %lf sec\n", (double)(end - start) / CLOCKS_PER_SEC);
+
+    free(sizes);
+}
+
+// Realloc benchmark: append-heavy growth, the way strings, vectors and log buffers grow. Several
+// buffers grow side by side so they get in each other's way, like they would in a real program.
+#define REALLOC_BUFFERS 8
+
+typedef struct {
+    const char *name;
+    size_t step;      // Bytes appended per realloc, 0 to grow by half instead
+    size_t max_size;
+    size_t rounds;
+} GrowthPattern;
+
+static const GrowthPattern growth_patterns[] = {
+    { "strings, +16 B up to 64 KiB", 16, 64 * 1024, 20 },
+    { "log buffers, +4 KiB up to 8 MiB", 4096, 8 * 1024 * 1024, 1 },
+    { "vectors, x1.5 up to 64 MiB", 0, 64 * 1024 * 1024, 4 },
+};
+
+// Grow every buffer to max_size and free them, touching the new tail after each step.
+// Returns how many reallocs moved a buffer.
+static size_t realloc_growth(void *(*resize)(void *, size_t), void (*release)(void *), const GrowthPattern *pattern) {
+    size_t moves = 0;
+
+    for (size_t round = 0; round < pattern->rounds; round++) {
+        void *bufs[REALLOC_BUFFERS] = {NULL};
+        size_t size = 0;
+        while (size < pattern->max_size) {
+            size_t next = pattern->step ? size + pattern->step : size + size / 2 + 64;
+            if (next > pattern->max_size) next = pattern->max_size;
+            for (size_t b = 0; b < REALLOC_BUFFERS; b++) {
+                void *grown = resize(bufs[b], next);
+                if (bufs[b] && grown != bufs[b]) moves++;
+                bufs[b] = grown;
+                memset((char *)grown + size, (int)b, next - size);
+            }
+            size = next;
+        }
+        for (size_t b = 0; b < REALLOC_BUFFERS; b++) {
+            release(bufs[b]);
+        }
+    }
+    return moves;
+}
+
+void benchmark_realloc() {
+    printf("Benchmarking append-heavy realloc (%d buffers growing side by side)...\n", REALLOC_BUFFERS);
+
+    for (size_t p = 0; p < sizeof(growth_patterns) / sizeof(growth_patterns[0]); p++) {
+        const GrowthPattern *pattern = &growth_patterns[p];
+
+        clock_t start = clock();
+        size_t libc_moves = realloc_growth(realloc, free, pattern);
+        clock_t end = clock();
+        double libc_time = (double)(end - start) / CLOCKS_PER_SEC;
+
+        start = clock();
+        size_t mm_moves = realloc_growth(mm_realloc, mm_free, pattern);
+        end = clock();
+        double mm_time = (double)(end - start) / CLOCKS_PER_SEC;
+
+        printf("  %-32s realloc: %lf sec (%zu moves), mm_realloc: %lf sec (%zu moves)\n",
+               pattern->name, libc_time, libc_moves, mm_time, mm_moves);
+    }
+}
+
+// Huge page benchmark: chase pointers through 4 KiB blocks in random order. Every access lands on
+// another page, so with 4 KiB pages nearly every one is a dTLB miss; 2 MiB pages cover the whole set.
+// Each backing runs in a forked child so it gets freshly mapped blocks.
+#define TLB_BLOCKS 65536         // 256 MiB of 4 KiB blocks
+#define TLB_ACCESSES 20000000
+
+// Kilobytes of this process' anonymous memory backed by transparent huge pages
+static size_t anon_huge_kb() {
+    FILE *smaps = fopen("/proc/self/smaps_rollup", "r");
+    char line[256];
+    size_t kb = 0;
+    if (!smaps) return 0;
+    while (fgets(line, sizeof(line), smaps)) {
+        if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) break;
+    }
+    fclose(smaps);
+    return kb;
+}
+
+static void tlb_access_run(int mode, const char *name) {
+    void **blocks = malloc(TLB_BLOCKS * sizeof(void *));
+    unsigned int seed = (unsigned int)time(NULL);
+
+    mm_set_huge_pages(mode);
+    for (size_t i = 0; i < TLB_BLOCKS; i++) {
+        blocks[i] = mm_malloc(4096);
+    }
+
+    // Link the blocks into a single random cycle (Sattolo's shuffle) so the chase visits all of them
+    for (size_t i = TLB_BLOCKS - 1; i > 0; i--) {
+        size_t j = rand_r(&seed) % i;
+        void *tmp = blocks[i];
+        blocks[i] = blocks[j];
+        blocks[j] = tmp;
+    }
+    for (size_t i = 0; i < TLB_BLOCKS; i++) {
+        *(void **)blocks[i] = blocks[(i + 1) % TLB_BLOCKS];
+    }
+
+    struct timespec start, end;
+    void *p = blocks[0];
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < TLB_ACCESSES; i++) {
+        p = *(void **)p;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    int used = __atomic_load_n(&mm_huge_pages, __ATOMIC_RELAXED);
+    printf("  %-8s %.2f ns/access, %zu kB in transparent huge pages%s%s\n", name,
+           elapsed * 1e9 / TLB_ACCESSES, anon_huge_kb(),
+           mode == MM_HUGE_HUGETLB && used == MM_HUGE_HUGETLB ? " (plus hugetlb pages)" : "",
+           mode == MM_HUGE_HUGETLB && used != MM_HUGE_HUGETLB ? " (no hugetlb pages reserved, used THP)" : "");
+    if (!p) printf("unreachable\n");  // Keep the chase from being optimized out
+
+    mm_free_batch(blocks, TLB_BLOCKS, 4096);
+    free(blocks);
+}
+
+void benchmark_huge_pages() {
+    static const struct { int mode; const char *name; } modes[] = {
+        { MM_HUGE_OFF, "4 KiB" }, { MM_HUGE_THP, "THP" }, { MM_HUGE_HUGETLB, "hugetlb" },
+    };
+    char thp[128] = "unknown";
+    FILE *setting = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (setting) {
+        if (fgets(thp, sizeof(thp), setting)) thp[strcspn(thp, "\n")] = 0;
+        fclose(setting);
+    }
+
+    printf("Random access over %d 4 KiB blocks (%d accesses), transparent huge pages: %s\n",
+           TLB_BLOCKS, TLB_ACCESSES, thp);
+    fflush(stdout);
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            tlb_access_run(modes[m].mode, modes[m].name);
+            fflush(stdout);
+            _exit(0);
+        }
+        if (pid > 0) waitpid(pid, NULL, 0);
+    }
+}
+
+// Decay benchmark: a traffic spike allocates a few hundred MiB of mixed sizes and frees it all again.
+// Then watch what the allocator keeps and what is actually resident while the purger gives it back.
+#define DECAY_MS 500
+#define DECAY_SPIKE 10000       // Allocations of 1KB - 128KB in the spike
+#define DECAY_SAMPLES 12
+#define DECAY_SAMPLE_MS 250
+
+void benchmark_decay() {
+    void **ptrs = malloc(DECAY_SPIKE * sizeof(void *));
+    unsigned int seed = (unsigned int)time(NULL);
+    size_t spike_bytes = 0;
+
+    mm_set_decay(DECAY_MS);
+    for (size_t i = 0; i < DECAY_SPIKE; i++) {
+        size_t range = (size_t)1024 << (rand_r(&seed) % 8);
+        size_t size = range / 2 + 1 + rand_r(&seed) % (range / 2);
+        ptrs[i] = mm_malloc(size);
+        memset(ptrs[i], 1, size);
+        spike_bytes += size;
+    }
+    for (size_t i = 0; i < DECAY_SPIKE; i++) {
+        mm_free(ptrs[i]);
+    }
+
+    printf("Freed a %zu MB spike, purging memory idle for %d ms:\n", spike_bytes >> 20, DECAY_MS);
+    printf("  %-8s %-14s %-14s %-14s %-14s\n", "Time", "Free pages MB", "Huge cache MB", "Purged MB", "Resident MB");
+    for (size_t sample = 0; sample <= DECAY_SAMPLES; sample++) {
+        pthread_mutex_lock(&page_heap.lock);
+        size_t free_pages = page_heap.free_bytes - page_heap.purged_bytes;  // Free runs not purged yet
+        size_t huge_cached = page_heap.huge_cached_bytes;
+        size_t purged = page_heap.purged_bytes;
+        pthread_mutex_unlock(&page_heap.lock);
+        printf("  %-8zu %-14zu %-14zu %-14zu %-14zu\n", sample * DECAY_SAMPLE_MS, free_pages >> 20, huge_cached >> 20,
+               purged >> 20, resident_bytes() >> 20);
+
+        struct timespec pause = { 0, DECAY_SAMPLE_MS * 1000000 };
+        nanosleep(&pause, NULL);
+    }
+
+    mm_set_decay(0);
+    free(ptrs);
+}
+
+// Trace replay: replay an allocation trace captured from a real process. A trace is a text file
+// with one operation per line, in timestamp order:
+//     <timestamp ns> <thread> <op> <size> <id>
+// where op is m (malloc), f (free) or r (realloc, resizing the allocation `id` to `size`), or a
+// binary capture made by running the program with LD_PRELOAD=./libmm.so MM_TRACE=<file>.
+// Every trace thread is replayed by its own thread. Operations on one id happen in trace order:
+// a thread freeing an allocation made by another one waits until it exists. Each allocator runs
+// in a forked child, so it starts from the same heap and its peak RSS is its own. Run under
+// LD_PRELOAD to replay against tcmalloc or jemalloc.
+#define TRACE_MAX_THREADS 64
+
+typedef struct {
+    char op;
+    uint32_t seq;  // Operations on this id before this one
+    size_t size;
+    size_t id;
+} TraceOp;
+
+typedef struct {
+    TraceOp *ops;
+    size_t count;
+    size_t capacity;
+    uint32_t *latencies;  // ns per op, filled in by the replay
+} TraceThread;
+
+typedef struct {
+    TraceThread threads[TRACE_MAX_THREADS];
+    size_t num_threads;
+    size_t num_ops;
+    size_t num_ids;
+    uint64_t dropped;  // Records the capture lost
+} Trace;
+
+typedef struct {
+    const char *name;
+    void *(*malloc)(size_t);
+    void (*free)(void *);
+    void *(*realloc)(void *, size_t);
+} BenchAllocator;
+
+// What the benchmarks that fork a child per allocator compare
+static const BenchAllocator bench_allocators[] = {
+    { "malloc", malloc, free, realloc },  // libc, or whatever LD_PRELOAD put in its place
+    { "mm_malloc", mm_malloc, mm_free, mm_realloc },
+};
+#define BENCH_ALLOCATORS (sizeof(bench_allocators) / sizeof(bench_allocators[0]))
+
+// An allocation being replayed: its pointer, and how many of its operations are done
+typedef struct {
+    void *ptr;
+    uint32_t seq;
+} ReplaySlot;
+
+typedef struct {
+    const BenchAllocator *allocator;
+    TraceThread *thread;
+    ReplaySlot *slots;  // By id
+    pthread_barrier_t *start;
+} ReplayArgs;
+
+// Builds a Trace from operations in timestamp order
+typedef struct {
+    Trace *trace;
+    uint64_t thread_ids[TRACE_MAX_THREADS];
+    size_t ids_size;
+    uint8_t *live;   // Ids allocated and not freed yet
+    uint32_t *seqs;  // Operations seen per id
+} TraceBuilder;
+
+// Add an operation, dropping frees and reallocs of allocations made before the capture started
+static void trace_add(TraceBuilder *builder, uint64_t thread_id, TraceOp op) {
+    Trace *trace = builder->trace;
+    if (op.id >= builder->ids_size) {
+        size_t new_size = builder->ids_size;
+        while (op.id >= new_size) new_size *= 2;
+        builder->live = realloc(builder->live, new_size);
+        builder->seqs = realloc(builder->seqs, new_size * sizeof(uint32_t));
+        memset(builder->live + builder->ids_size, 0, new_size - builder->ids_size);
+        memset(builder->seqs + builder->ids_size, 0, (new_size - builder->ids_size) * sizeof(uint32_t));
+        builder->ids_size = new_size;
+    }
+    if (op.op != 'm' && !builder->live[op.id]) {
+        if (op.op == 'f') return;
+        op.op = 'm';  // Realloc of an allocation we never saw: it is new to us
+    }
+    builder->live[op.id] = op.op != 'f';
+    op.seq = builder->seqs[op.id]++;
+    if (op.id >= trace->num_ids) trace->num_ids = op.id + 1;
+    if (op.size == 0 && op.op != 'f') op.size = 1;
+
+    size_t t = 0;
+    while (t < trace->num_threads && builder->thread_ids[t] != thread_id) t++;
+    if (t == trace->num_threads) {
+        if (t == TRACE_MAX_THREADS) t = thread_id % TRACE_MAX_THREADS;  // Fold extra threads
+        else builder->thread_ids[trace->num_threads++] = thread_id;
+    }
+
+    TraceThread *thread = &trace->threads[t];
+    if (thread->count == thread->capacity) {
+        thread->capacity = thread->capacity ? thread->capacity * 2 : 4096;
+        thread->ops = realloc(thread->ops, thread->capacity * sizeof(TraceOp));
+    }
+    thread->ops[thread->count++] = op;
+    trace->num_ops++;
+}
+
+static void load_text_trace(FILE *in, TraceBuilder *builder) {
+    char line[256];
+    while (fgets(line, sizeof(line), in)) {
+        uint64_t timestamp, thread_id;
+        TraceOp op;
+        if (sscanf(line, "%lu %lu %c %zu %zu", &timestamp, &thread_id, &op.op, &op.size, &op.id) != 5) continue;
+        if (op.op != 'm' && op.op != 'f' && op.op != 'r') continue;
+        trace_add(builder, thread_id, op);
+    }
+}
+
+// Pointers live in a binary trace and the ids of their allocations: open addressing, linear probing
+typedef struct {
+    uint64_t *ptrs;  // 0: empty
+    size_t *ids;
+    size_t mask;
+    size_t count;
+} PtrMap;
+
+static size_t ptr_map_home(const PtrMap *map, uint64_t ptr) {
+    return (size_t)((ptr >> 4) * 0x9E3779B97F4A7C15ULL >> 20) & map->mask;
+}
+
+static size_t ptr_map_slot(const PtrMap *map, uint64_t ptr) {
+    size_t slot = ptr_map_home(map, ptr);
+    while (map->ptrs[slot] && map->ptrs[slot] != ptr) slot = (slot + 1) & map->mask;
+    return slot;
+}
+
+static void ptr_map_put(PtrMap *map, uint64_t ptr, size_t id) {
+    if (2 * (map->count + 1) > map->mask + 1) {
+        PtrMap grown = { calloc(2 * (map->mask + 1), sizeof(uint64_t)), malloc(2 * (map->mask + 1) * sizeof(size_t)),
+                         2 * map->mask + 1, map->count };
+        for (size_t i = 0; i <= map->mask; i++) {
+            if (!map->ptrs[i]) continue;
+            size_t slot = ptr_map_slot(&grown, map->ptrs[i]);
+            grown.ptrs[slot] = map->ptrs[i];
+            grown.ids[slot] = map->ids[i];
+        }
+        free(map->ptrs);
+        free(map->ids);
+        *map = grown;
+    }
+    size_t slot = ptr_map_slot(map, ptr);
+    if (!map->ptrs[slot]) map->count++;  // Otherwise its free was dropped: it is a new allocation now
+    map->ptrs[slot] = ptr;
+    map->ids[slot] = id;
+}
+
+// Remove `ptr`, returning its id or SIZE_MAX if it is not live
+static size_t ptr_map_take(PtrMap *map, uint64_t ptr) {
+    size_t slot = ptr_map_slot(map, ptr);
+    if (!map->ptrs[slot]) return SIZE_MAX;
+    size_t id = map->ids[slot];
+
+    // Shift back the entries after it that would no longer be found past the hole
+    size_t hole = slot;
+    for (size_t i = (slot + 1) & map->mask; map->ptrs[i]; i = (i + 1) & map->mask) {
+        size_t home = ptr_map_home(map, map->ptrs[i]);
+        if (((i - home) & map->mask) >= ((i - hole) & map->mask)) {
+            map->ptrs[hole] = map->ptrs[i];
+            map->ids[hole] = map->ids[i];
+            hole = i;
+        }
+    }
+    map->ptrs[hole] = 0;
+    map->count--;
+    return id;
+}
+
+// Stable, so records with the same timestamp keep their per-thread order
+static void sort_records(TraceRecord *records, TraceRecord *scratch, size_t count) {
+    if (count < 2) return;
+    size_t half = count / 2;
+    sort_records(records, scratch, half);
+    sort_records(records + half, scratch, count - half);
+
+    size_t i = 0, j = half, k = 0;
+    while (i < half && j < count) {
+        scratch[k++] = records[j].timestamp < records[i].timestamp ? records[j++] : records[i++];
+    }
+    while (i < half) scratch[k++] = records[i++];
+    memcpy(records, scratch, k * sizeof(TraceRecord));
+}
+
+// A capture from the MM_TRACE shim: merge the threads by timestamp and give every allocation an id
+static void load_binary_trace(FILE *in, TraceBuilder *builder) {
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1) return;
+    builder->trace->dropped = header.dropped;
+
+    size_t count = 0, capacity = 1 << 16;
+    TraceRecord *records = malloc(capacity * sizeof(TraceRecord));
+    size_t n;
+    while ((n = fread(records + count, sizeof(TraceRecord), capacity - count, in)) > 0) {
+        count += n;
+        if (count == capacity) {
+            capacity *= 2;
+            records = realloc(records, capacity * sizeof(TraceRecord));
+        }
+    }
+    TraceRecord *scratch = malloc(count * sizeof(TraceRecord) + 1);
+    sort_records(records, scratch, count);
+    free(scratch);
+
+    PtrMap map = { calloc(1024, sizeof(uint64_t)), malloc(1024 * sizeof(size_t)), 1023, 0 };
+    size_t resizing[1 << 14];  // Per capture thread: the allocation its realloc in progress is resizing
+    memset(resizing, 0xff, sizeof(resizing));
+    size_t next_id = 0;
+    for (size_t i = 0; i < count; i++) {
+        const TraceRecord *record = &records[i];
+        TraceOp op = { 'm', 0, record->size, 0 };
+        if (record->op == TRACE_REALLOC_FROM) {
+            resizing[record->thread] = ptr_map_take(&map, record->ptr);
+            continue;
+        }
+        if (record->op == TRACE_FREE) {
+            op.op = 'f';
+            if ((op.id = ptr_map_take(&map, record->ptr)) == SIZE_MAX) continue;
+        } else if (record->op == TRACE_REALLOC && resizing[record->thread] != SIZE_MAX) {
+            op.op = record->ptr ? 'r' : 'f';  // realloc(ptr, 0) frees
+            op.id = resizing[record->thread];
+        } else if (record->ptr) {
+            op.id = next_id++;  // A malloc, or a realloc whose start was dropped
+        } else {
+            continue;
+        }
+        resizing[record->thread] = SIZE_MAX;
+        if (op.op != 'f') ptr_map_put(&map, record->ptr, op.id);
+        trace_add(builder, record->thread, op);
+    }
+    free(map.ptrs);
+    free(map.ids);
+    free(records);
+}
+
+// Read a text trace, or a binary one captured with MM_TRACE. Returns 0 on success.
+static int load_trace(const char *path, Trace *trace) {
+    FILE *in = fopen(path, "rb");
+    if (!in) return -1;
+
+    TraceBuilder builder = { .trace = trace, .ids_size = 1024 };
+    builder.live = calloc(builder.ids_size, 1);
+    builder.seqs = calloc(builder.ids_size, sizeof(uint32_t));
+    memset(trace, 0, sizeof(*trace));
+
+    char magic[8];
+    if (fread(magic, 1, sizeof(magic), in) == sizeof(magic) && memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0) {
+        rewind(in);
+        load_binary_trace(in, &builder);
+    } else {
+        rewind(in);
+        load_text_trace(in, &builder);
+    }
+    fclose(in);
+    free(builder.live);
+    free(builder.seqs);
+    return 0;
+}
+
+static void *replay_thread(void *arg) {
+    ReplayArgs *args = (ReplayArgs *)arg;
+    const BenchAllocator *allocator = args->allocator;
+    TraceThread *thread = args->thread;
+    struct timespec start, end;
+
+    pthread_barrier_wait(args->start);
+    for (size_t i = 0; i < thread->count; i++) {
+        const TraceOp *op = &thread->ops[i];
+        ReplaySlot *slot = &args->slots[op->id];
+
+        // Wait for the operations before this one on the same id, possibly on other threads
+        while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != op->seq) sched_yield();
+        void *ptr = slot->ptr;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (op->op == 'm') {
+            ptr = allocator->malloc(op->size);
+        } else if (op->op == 'r') {
+            ptr = allocator->realloc(ptr, op->size);
+        } else {
+            allocator->free(ptr);
+            ptr = NULL;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        thread->latencies[i] = (uint32_t)((end.tv_sec - start.tv_sec) * 1000000000L + end.tv_nsec - start.tv_nsec);
+
+        if (ptr) *(char *)ptr = 1;  // Touch it like the traced program would
+        slot->ptr = ptr;
+        __atomic_store_n(&slot->seq, op->seq + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void replay_trace_with(Trace *trace, const BenchAllocator *allocator) {
+    ReplaySlot *slots = calloc(trace->num_ids, sizeof(ReplaySlot));
+    pthread_t threads[TRACE_MAX_THREADS];
+    ReplayArgs args[TRACE_MAX_THREADS];
+    pthread_barrier_t start_barrier;
+    struct timespec start, end;
+
+    pthread_barrier_init(&start_barrier, NULL, trace->num_threads + 1);
+    for (size_t t = 0; t < trace->num_threads; t++) {
+        trace->threads[t].latencies = malloc(trace->threads[t].count * sizeof(uint32_t));
+        args[t] = (ReplayArgs){ allocator, &trace->threads[t], slots, &start_barrier };
+        pthread_create(&threads[t], NULL, replay_thread, &args[t]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_barrier_wait(&start_barrier);
+    for (size_t t = 0; t < trace->num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    // Gather every thread's latencies for the percentiles
+    uint32_t *latencies = malloc(trace->num_ops * sizeof(uint32_t));
+    size_t n = 0;
+    for (size_t t = 0; t < trace->num_threads; t++) {
+        memcpy(latencies + n, trace->threads[t].latencies, trace->threads[t].count * sizeof(uint32_t));
+        n += trace->threads[t].count;
+    }
+    qsort(latencies, n, sizeof(uint32_t), compare_u32);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("  %-10s %8.3f sec %12.0f ops/sec  p50 %5u  p90 %5u  p99 %6u  p99.9 %7u  max %8u ns  peak RSS %zu MB\n",
+           allocator->name, elapsed, n / elapsed, latencies[n / 2], latencies[n * 9 / 10], latencies[n * 99 / 100],
+           latencies[n * 999 / 1000], latencies[n - 1], (size_t)usage.ru_maxrss >> 10);
+    free(latencies);
+}
+
+void replay_trace(const char *path) {
+    Trace trace;
+
+    if (load_trace(path, &trace) != 0 || trace.num_ops == 0) {
+        printf("Could not read a trace from %s\n", path);
+        return;
+    }
+    printf("Replaying %zu operations on %zu threads from %s...\n", trace.num_ops, trace.num_threads, path);
+    if (trace.dropped) printf("  (the capture dropped %lu records: some allocations are never freed)\n", trace.dropped);
+    fflush(stdout);
+
+    for (size_t a = 0; a < BENCH_ALLOCATORS; a++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            replay_trace_with(&trace, &bench_allocators[a]);
+            fflush(stdout);
+            _exit(0);
+        }
+        if (pid > 0) waitpid(pid, NULL, 0);
+    }
+    for (size_t t = 0; t < trace.num_threads; t++) {
+        free(trace.threads[t].ops);
+    }
+}
+
+// Cross-thread benchmark: how allocation scales with threads when memory changes hands, as when a
+// network thread allocates requests that worker threads free. Patterns:
+//   churn  every thread allocates and frees its own memory (the baseline)
+//   pc     threads in pairs, a producer allocating messages and a consumer freeing them
+//   a2a    all-to-all, every thread sends messages to every thread and frees what it receives
+// Messages go through single-producer rings. Each allocator, pattern and thread count runs in a
+// forked child, so peak RSS is that run's own.
+#define CROSS_MESSAGES 200000  // Allocations per thread (per producer for pc)
+#define CROSS_LIVE 1024        // Allocations each churn thread keeps
+#define CROSS_RING 256         // Messages in flight between two threads
+#define CROSS_MAX_THREADS 256
+
+static const size_t cross_sizes[] = { 32, 64, 96, 128, 256, 512, 1024, 2048 };
+static const char *cross_patterns[] = { "churn", "pc", "a2a" };
+#define CROSS_PATTERNS (sizeof(cross_patterns) / sizeof(cross_patterns[0]))
 
-// Memory manager structure
 typedef struct {
-    FreeBlock *free_list[CHUNK_CLASSES];  // Free lists for each chunk size
-    size_t preallocated_counts[CHUNK_CLASSES]; // Track preallocated blocks per chunk size
-} MemoryManager;
+    void *slots[CROSS_RING];
+    size_t head __attribute__((aligned(64)));  // Written by the sender
+    size_t tail __attribute__((aligned(64)));  // Written by the receiver
+} CrossRing;
 
-MemoryManager mem_manager = { {NULL}, {0} };  // Initialize all lists to NULL
+typedef struct {
+    const BenchAllocator *allocator;
+    size_t pattern;
+    size_t id;
+    size_t num_threads;
+    CrossRing *rings;  // pc: one per pair. a2a: num_threads x num_threads, by sender then receiver.
+    pthread_barrier_t *start;
+} CrossArgs;
 
-// Power-of-2 chunk sizes
-size_t chunk_sizes[] = {4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536};
+static void *cross_message(const BenchAllocator *allocator, unsigned int *seed) {
+    size_t size = cross_sizes[rand_r(seed) % (sizeof(cross_sizes) / sizeof(cross_sizes[0]))];
+    size_t *message = allocator->malloc(size);
+    message[0] = size;  // Written here, read where it is freed
+    return message;
+}
 
-// Get index for chunk size (smallest power of 2 greater than or equal to `size`)
-size_t get_chunk_index(size_t size) {
-    if (size == 0) return 0;  // Edge case
+static int cross_send(CrossRing *ring, void *message) {
+    size_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == CROSS_RING) return 0;
+    ring->slots[head % CROSS_RING] = message;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
 
-    // Round up to the next power of 2 (only if not already a power of 2)
-    if (size & (size - 1)) {
-        size = 1ULL << (64 - __builtin_clzll(size));  // Find next power of 2
+// Free everything waiting in the ring, returns how many
+static size_t cross_drain(CrossRing *ring, const BenchAllocator *allocator, size_t *checksum) {
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t tail = ring->tail;
+    for (; tail != head; tail++) {
+        size_t *message = ring->slots[tail % CROSS_RING];
+        *checksum += message[0];
+        allocator->free(message);
     }
+    size_t count = tail - ring->tail;
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return count;
+}
+
+static void *cross_thread(void *arg) {
+    CrossArgs *args = (CrossArgs *)arg;
+    const BenchAllocator *allocator = args->allocator;
+    unsigned int seed = (unsigned int)args->id + 1;
+    size_t checksum = 0;
 
-    return __builtin_ctzll(size / 4);  // Compute index (divide by 4 to match array)
+    pthread_barrier_wait(args->start);
+    if (args->pattern == 0) {
+        void *live[CROSS_LIVE] = {NULL};
+        for (size_t i = 0; i < CROSS_MESSAGES; i++) {
+            size_t slot = rand_r(&seed) % CROSS_LIVE;
+            if (live[slot]) allocator->free(live[slot]);
+            live[slot] = cross_message(allocator, &seed);
+        }
+        for (size_t slot = 0; slot < CROSS_LIVE; slot++) {
+            if (live[slot]) allocator->free(live[slot]);
+        }
+    } else if (args->pattern == 1) {
+        CrossRing *ring = &args->rings[args->id / 2];
+        if (args->id % 2 == 0) {
+            for (size_t i = 0; i < CROSS_MESSAGES; i++) {
+                void *message = cross_message(allocator, &seed);
+                while (!cross_send(ring, message)) sched_yield();
+            }
+        } else {
+            for (size_t received = 0; received < CROSS_MESSAGES;) {
+                size_t count = cross_drain(ring, allocator, &checksum);
+                if (!count) sched_yield();
+                received += count;
+            }
+        }
+    } else {
+        // Send round robin, so every thread receives exactly CROSS_MESSAGES. Drain while a ring is
+        // full, or two threads sending to each other would wait forever.
+        size_t n = args->num_threads, received = 0;
+        for (size_t i = 0; i < CROSS_MESSAGES; i++) {
+            CrossRing *ring = &args->rings[args->id * n + (args->id + 1 + i) % n];
+            void *message = cross_message(allocator, &seed);
+            while (!cross_send(ring, message)) {
+                for (size_t from = 0; from < n; from++) {
+                    received += cross_drain(&args->rings[from * n + args->id], allocator, &checksum);
+                }
+                sched_yield();
+            }
+        }
+        while (received < CROSS_MESSAGES) {
+            size_t count = 0;
+            for (size_t from = 0; from < n; from++) {
+                count += cross_drain(&args->rings[from * n + args->id], allocator, &checksum);
+            }
+            if (!count) sched_yield();
+            received += count;
+        }
+    }
+    return (void *)checksum;
 }
 
-// Evenly distribute preallocated memory across chunk sizes in a cyclic manner
-void preallocate_memory(size_t total_memory) {
-    size_t allocated_memory = 0;
-    size_t i = 0; // Start at chunk size 4 bytes
+// Run one pattern on `num_threads` threads, returns the allocations and frees per second
+static double cross_run(const BenchAllocator *allocator, size_t pattern, size_t num_threads) {
+    pthread_t threads[CROSS_MAX_THREADS];
+    CrossArgs args[CROSS_MAX_THREADS];
+    pthread_barrier_t start_barrier;
+    struct timespec start, end;
 
-    while (allocated_memory + chunk_sizes[i] <= total_memory*2) {
-        // Allocate a single block at each chunk size in order
-        FreeBlock *block = (FreeBlock *)malloc(chunk_sizes[i]);
-        if (!block) {
-            printf("Failed to allocate memory\n");
-            exit(1);
+    size_t num_rings = pattern == 2 ? num_threads * num_threads : num_threads / 2 + 1;
+    CrossRing *rings = mmap(NULL, num_rings * sizeof(CrossRing), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (rings == MAP_FAILED) return 0;
+
+    pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+    for (size_t t = 0; t < num_threads; t++) {
+        args[t] = (CrossArgs){ allocator, pattern, t, num_threads, rings, &start_barrier };
+        pthread_create(&threads[t], NULL, cross_thread, &args[t]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_barrier_wait(&start_barrier);
+    for (size_t t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_barrier_destroy(&start_barrier);
+    munmap(rings, num_rings * sizeof(CrossRing));
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    size_t senders = pattern == 1 ? num_threads / 2 : num_threads;
+    return 2.0 * senders * CROSS_MESSAGES / elapsed;
+}
+
+// `spec` is a pattern or "all", optionally followed by :<max threads> (default 16). Thread counts
+// double from 1 (2 for pc, which needs pairs) up to the maximum, which always runs.
+void benchmark_cross_thread(const char *spec) {
+    char name[16];
+    size_t max_threads = 16;
+    if (sscanf(spec, "%15[^:]:%zu", name, &max_threads) < 1 || max_threads == 0 || max_threads > CROSS_MAX_THREADS) {
+        printf("Bad cross-thread benchmark spec %s, expected <churn|pc|a2a|all>[:<max threads>]\n", spec);
+        return;
+    }
+
+    printf("Cross-thread benchmark, %d allocations per sending thread:\n", CROSS_MESSAGES);
+    printf("%-8s %8s", "Pattern", "Threads");
+    for (size_t a = 0; a < BENCH_ALLOCATORS; a++) {
+        printf("  %12s ops/sec %8s", bench_allocators[a].name, "peak RSS");
+    }
+    printf("\n");
+
+    for (size_t p = 0; p < CROSS_PATTERNS; p++) {
+        if (strcmp(name, "all") != 0 && strcmp(name, cross_patterns[p]) != 0) continue;
+
+        size_t limit = p == 1 ? max_threads & ~(size_t)1 : max_threads;  // pc runs whole pairs
+        for (size_t num_threads = p == 1 ? 2 : 1; num_threads <= limit;) {
+            printf("%-8s %8zu", cross_patterns[p], num_threads);
+            fflush(stdout);
+            for (size_t a = 0; a < BENCH_ALLOCATORS; a++) {
+                // The child sends back its throughput and peak RSS
+                int fds[2];
+                double result[2] = {0, 0};
+                if (pipe(fds) != 0) return;
+                pid_t pid = fork();
+                if (pid == 0) {
+                    close(fds[0]);
+                    result[0] = cross_run(&bench_allocators[a], p, num_threads);
+                    struct rusage usage;
+                    getrusage(RUSAGE_SELF, &usage);
+                    result[1] = usage.ru_maxrss / 1024.0;
+                    if (write(fds[1], result, sizeof(result)) != sizeof(result)) _exit(1);
+                    _exit(0);
+                }
+                close(fds[1]);
+                if (pid > 0) {
+                    if (read(fds[0], result, sizeof(result)) != sizeof(result)) result[0] = result[1] = 0;
+                    waitpid(pid, NULL, 0);
+                }
+                close(fds[0]);
+                printf("  %20.0f %5.0f MB", result[0], result[1]);
+            }
+            printf("\n");
+            if (num_threads == limit) break;
+            num_threads = num_threads * 2 < limit ? num_threads * 2 : limit;
         }
-        block->next = mem_manager.free_list[i];
-        mem_manager.free_list[i] = block;
-        mem_manager.preallocated_counts[i]++;  // Track preallocated blocks
+    }
+}
 
-        allocated_memory += chunk_sizes[i];
+#define NUMA_BENCH_BYTES (128 * 1024 * 1024)  // Allocated on each node, well past the last level cache
+#define NUMA_BENCH_BLOCK 65536                // Block size: the largest chunk class
+#define NUMA_BENCH_PASSES 5                   // The best pass counts
 
-        // Move to the next chunk size (loop back to 0 if needed)
-        i = (i + 1) % CHUNK_CLASSES;
+enum { NUMA_ALLOC, NUMA_READ, NUMA_WRITE };
+
+typedef struct {
+    size_t node;      // Node whose CPUs run the job
+    int op;
+    char **blocks;
+    size_t count;
+    double seconds;   // Best pass
+    uint64_t checksum;
+} NumaJob;
+
+// Pin the calling thread to the CPUs of a node. Returns 0 if the node has none.
+static int numa_pin(size_t node) {
+    char path[64], list[1024];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/cpulist", node);
+    FILE *file = fopen(path, "r");
+    if (!file) return node == 0;  // No NUMA in the kernel: one node, nothing to pin
+    int ok = fgets(list, sizeof(list), file) != NULL;
+    fclose(file);
+    if (!ok) return 0;
+
+    // Ranges like "0-3,8-11"
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (char *range = strtok(list, ",\n"); range; range = strtok(NULL, ",\n")) {
+        int first, last;
+        int fields = sscanf(range, "%d-%d", &first, &last);
+        if (fields < 1) continue;
+        if (fields == 1) last = first;
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, &cpus);
     }
-    
-    printf("Preallocated %zu bytes of memory in a cyclic manner across all chunk sizes.\n", allocated_memory);
+    return CPU_COUNT(&cpus) > 0 && sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
 }
 
-// Custom malloc (allocates from free list or falls back to malloc)
-void *mm_malloc(size_t size) {
-    if (size == 0 || size > MAX_CHUNK_SIZE) return NULL;  // Invalid size
+static void *numa_job(void *arg) {
+    NumaJob *job = (NumaJob *)arg;
+    if (!numa_pin(job->node)) {
+        job->seconds = 0;
+        return NULL;
+    }
 
-    size_t index = get_chunk_index(size);
-    if (mem_manager.free_list[index]) {
-        // Take from free list
-        FreeBlock *block = mem_manager.free_list[index];
-        mem_manager.free_list[index] = block->next;
-        return (void *)block;
+    if (job->op == NUMA_ALLOC) {
+        // The thread's first allocation maps it to the node it is pinned to
+        for (size_t i = 0; i < job->count; i++) {
+            job->blocks[i] = mm_malloc(NUMA_BENCH_BLOCK);
+            memset(job->blocks[i], (int)i, NUMA_BENCH_BLOCK);
+        }
+        job->seconds = 1;
+        return NULL;
     }
 
-    // Fallback: Allocate new memory if no preallocated blocks are available
-    return malloc(chunk_sizes[index]);
+    job->seconds = 0;
+    for (size_t pass = 0; pass < NUMA_BENCH_PASSES; pass++) {
+        uint64_t start = monotonic_ns();
+        for (size_t i = 0; i < job->count; i++) {
+            if (job->op == NUMA_READ) {
+                const uint64_t *words = (const uint64_t *)job->blocks[i];
+                uint64_t sum = 0;
+                for (size_t w = 0; w < NUMA_BENCH_BLOCK / sizeof(uint64_t); w++) sum += words[w];
+                job->checksum += sum;
+            } else {
+                memset(job->blocks[i], (int)pass, NUMA_BENCH_BLOCK);
+            }
+        }
+        double seconds = (monotonic_ns() - start) / 1e9;
+        if (job->seconds == 0 || seconds < job->seconds) job->seconds = seconds;
+    }
+    return NULL;
 }
 
-// Custom free
-void mm_free(void *ptr, size_t size) {
-    if (!ptr || size == 0 || size > MAX_CHUNK_SIZE) return;
+// Run a job on a thread pinned to its node. Returns 0 if the node has no CPUs.
+static int numa_run(NumaJob *job) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, numa_job, job) != 0) return 0;
+    pthread_join(thread, NULL);
+    return job->seconds > 0;
+}
 
-    size_t index = get_chunk_index(size);
-    FreeBlock *block = (FreeBlock *)ptr;
-    block->next = mem_manager.free_list[index];
-    mem_manager.free_list[index] = block;
+// Node the page at `ptr` is on, -1 if the kernel cannot tell
+static int numa_page_node(void *ptr) {
+    int node;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, ptr, NUMA_MPOL_F_NODE | NUMA_MPOL_F_ADDR) != 0) return -1;
+    return node;
 }
 
-// Generate a list of random sizes summing up to approximately `total_size`
-size_t generate_random_sizes(size_t total_size, size_t *sizes, size_t max_count, size_t *requested_counts) {
-    size_t num_sizes = 0;
-    size_t used_memory = 0;
-    srand(time(NULL));  // Seed random generator
+// Local vs. remote memory bandwidth: blocks are allocated by a thread on each node (so they come from
+// that node's arena), then read and written by threads on every node. Also checks that the pages of
+// each node's blocks really ended up on that node.
+void benchmark_numa() {
+    mm_init();
+    size_t nodes = mm_numa_nodes, count = NUMA_BENCH_BYTES / NUMA_BENCH_BLOCK;
+    printf("NUMA bandwidth benchmark: %zu node%s, %d MB of %d byte blocks per node, best of %d passes\n",
+           nodes, nodes == 1 ? "" : "s", NUMA_BENCH_BYTES >> 20, NUMA_BENCH_BLOCK, NUMA_BENCH_PASSES);
+    if (nodes == 1) printf("Single node (or MM_NUMA=off, or a memory policy set): only local bandwidth is measured\n");
 
-    while (used_memory < total_size && num_sizes < max_count) {
-        size_t rand_index = rand() % CHUNK_CLASSES;
-        size_t chunk_size = chunk_sizes[rand_index];
+    // Every node's blocks are kept until all nodes are measured: freed earlier, the next node's
+    // allocations could get them back (through the central lists or a reclaimed remote queue)
+    char **all_blocks = calloc(nodes * count, sizeof(char *));
+    uint64_t checksum = 0;
+    printf("%-12s %-12s %10s %12s %12s\n", "Memory node", "CPU node", "On node", "Read GB/s", "Write GB/s");
+    for (size_t mem_node = 0; mem_node < nodes; mem_node++) {
+        char **blocks = all_blocks + mem_node * count;
+        NumaJob alloc_job = { mem_node, NUMA_ALLOC, blocks, count, 0, 0 };
+        if (!numa_run(&alloc_job)) {
+            printf("%-12zu (no CPUs to allocate from)\n", mem_node);
+            continue;
+        }
 
-        if (used_memory + chunk_size > total_size) break;  // Stop if we exceed the limit
+        size_t pages = 0, on_node = 0;
+        for (size_t i = 0; i < count; i++) {
+            for (size_t offset = 0; offset < NUMA_BENCH_BLOCK; offset += PAGE_SIZE, pages++) {
+                on_node += numa_page_node(blocks[i] + offset) == (int)mem_node;
+            }
+        }
 
-        sizes[num_sizes++] = chunk_size;
-        used_memory += chunk_size;
-        requested_counts[rand_index]++;  // Track requested sizes
+        for (size_t cpu_node = 0; cpu_node < nodes; cpu_node++) {
+            NumaJob read_job = { cpu_node, NUMA_READ, blocks, count, 0, 0 };
+            NumaJob write_job = { cpu_node, NUMA_WRITE, blocks, count, 0, 0 };
+            if (!numa_run(&read_job) || !numa_run(&write_job)) continue;
+            checksum += read_job.checksum;
+            printf("%-12zu %-4zu %-7s %9.1f%% %12.2f %12.2f\n", mem_node, cpu_node,
+                   cpu_node == mem_node ? "local" : "remote", 100.0 * on_node / pages,
+                   NUMA_BENCH_BYTES / read_job.seconds / 1e9, NUMA_BENCH_BYTES / write_job.seconds / 1e9);
+        }
     }
+    for (size_t i = 0; i < nodes * count; i++) mm_free(all_blocks[i]);  // NULL where a node had no CPUs
+    free(all_blocks);
+    if (checksum == 1) printf("\n");  // Keep the reads from being optimized out
+}
 
-    return num_sizes;  // Return actual number of allocations
+#define CACHE_BENCH_ROUNDS 200  // Bursts of cross_sizes allocations per thread before it parks
+#define CACHE_BENCH_BURST 64
+
+typedef struct {
+    pthread_barrier_t parked;   // All threads did their work and hold their caches...
+    pthread_barrier_t release;  // ...until the main thread took its snapshot
+} CacheBench;
+
+static void *cache_bench_thread(void *arg) {
+    CacheBench *bench = (CacheBench *)arg;
+    unsigned int seed = (unsigned int)(uintptr_t)pthread_self();
+    void *blocks[CACHE_BENCH_BURST];
+    for (size_t round = 0; round < CACHE_BENCH_ROUNDS; round++) {
+        for (size_t k = 0; k < CACHE_BENCH_BURST; k++) {
+            blocks[k] = mm_malloc(cross_sizes[rand_r(&seed) % (sizeof(cross_sizes) / sizeof(cross_sizes[0]))]);
+        }
+        for (size_t k = 0; k < CACHE_BENCH_BURST; k++) mm_free(blocks[k]);
+    }
+    pthread_barrier_wait(&bench->parked);
+    pthread_barrier_wait(&bench->release);
+    return NULL;
 }
 
-// Debugging: Print memory usage statistics
-void print_memory_stats(size_t *preallocated_counts, size_t *requested_counts) {
-    printf("\nMemory Statistics:\n");
-    printf("%-10s %-15s %-15s\n", "Chunk Size", "Preallocated", "Requested");
-    
-    for (size_t i = 0; i < CHUNK_CLASSES; i++) {
-        printf("%-10zu %-15zu %-15zu\n", chunk_sizes[i], preallocated_counts[i], requested_counts[i]);
+// Start `num_threads` threads that allocate a little and then stay alive, like one thread per
+// connection. Returns ops/sec, and the bytes held in caches and the resident set while all are alive.
+static double cache_bench_run(size_t num_threads, double *cached_mb, double *resident_mb) {
+    CacheBench bench;
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    pthread_barrier_init(&bench.parked, NULL, num_threads + 1);
+    pthread_barrier_init(&bench.release, NULL, num_threads + 1);
+
+    uint64_t start = monotonic_ns();
+    size_t started = 0;
+    while (started < num_threads && pthread_create(&threads[started], &attr, cache_bench_thread, &bench) == 0) started++;
+    if (started < num_threads) {
+        printf("Could only start %zu threads\n", started);
+        exit(1);
     }
+    pthread_barrier_wait(&bench.parked);
+    double seconds = (monotonic_ns() - start) / 1e9;
+
+    MMStats stats;
+    mm_stats(&stats);
+    size_t cached = 0;
+    for (size_t i = 0; i < CHUNK_CLASSES; i++) cached += stats.classes[i].cached_free * chunk_sizes[i];
+    *cached_mb = cached / 1048576.0;
+    *resident_mb = stats.resident / 1048576.0;
+
+    pthread_barrier_wait(&bench.release);
+    for (size_t t = 0; t < num_threads; t++) pthread_join(threads[t], NULL);
+    pthread_barrier_destroy(&bench.parked);
+    pthread_barrier_destroy(&bench.release);
+    pthread_attr_destroy(&attr);
+    free(threads);
+    return 2.0 * num_threads * CACHE_BENCH_ROUNDS * CACHE_BENCH_BURST / seconds;
 }
 
-// Benchmark function
-void benchmark(size_t total_memory) {
-    const size_t max_allocations = 100000;
-    size_t *sizes = malloc(max_allocations * sizeof(size_t));
-    void **ptrs = malloc(max_allocations * sizeof(void *));
-    size_t requested_counts[CHUNK_CLASSES] = {0};  // Track actual requested sizes
-    
-    if (!sizes || !ptrs) {
-        printf("Memory allocation failed for benchmark setup.\n");
-        return;
+// Bytes held in thread caches vs. per-CPU caches as the number of live threads grows. Each run is a
+// fresh child process.
+void benchmark_cache_modes(size_t max_threads) {
+    static const char *modes[] = { "thread", "per-CPU" };
+    printf("Cache memory with many live threads, %d allocations per thread:\n", CACHE_BENCH_ROUNDS * CACHE_BENCH_BURST);
+    printf("%-8s %8s %14s %10s %10s\n", "Caches", "Threads", "ops/sec", "cached MB", "RSS MB");
+    for (size_t mode = 0; mode < 2; mode++) {
+        for (size_t num_threads = 1; num_threads <= max_threads;) {
+            int fds[2];
+            double result[3] = {0, 0, 0};
+            if (pipe(fds) != 0) return;
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(fds[0]);
+                if (mode == 1 && !mm_set_percpu(1)) {
+                    result[0] = -1;  // No rseq here
+                } else {
+                    result[0] = cache_bench_run(num_threads, &result[1], &result[2]);
+                }
+                if (write(fds[1], result, sizeof(result)) != sizeof(result)) _exit(1);
+                _exit(0);
+            }
+            close(fds[1]);
+            if (pid > 0) {
+                if (read(fds[0], result, sizeof(result)) != sizeof(result)) result[0] = 0;
+                waitpid(pid, NULL, 0);
+            }
+            close(fds[0]);
+            if (result[0] < 0) {
+                printf("%-8s (rseq is not available, threads keep their thread caches)\n", modes[mode]);
+                break;
+            }
+            printf("%-8s %8zu %14.0f %10.1f %10.1f\n", modes[mode], num_threads, result[0], result[1], result[2]);
+            if (num_threads == max_threads) break;
+            num_threads = num_threads * 4 < max_threads ? num_threads * 4 : max_threads;
+        }
     }
+}
 
-    size_t num_allocations = generate_random_sizes(total_memory, sizes, max_allocations, requested_counts);
+#define ALIGNED_ROUNDS 20   // Repetitions of each alignment's allocate/free batch
+#define ALIGNED_BLOCKS 256  // Blocks allocated and freed together
 
-    printf("Benchmarking with %zu allocations totaling ~%zu bytes...\n", num_allocations, total_memory);
+// mm_aligned_alloc vs. posix_memalign for SIMD (16-64), page (4096) and larger alignments: time per
+// allocate + free, bytes reserved beyond the request, and a check that every block is aligned
+void benchmark_aligned() {
+    static const size_t alignments[] = {16, 32, 64, 4096, 65536, 2 * 1024 * 1024};
+    static const size_t sizes[] = {24, 100, 1000, 5000, 100000};
+    void *ptrs[ALIGNED_BLOCKS];
+    size_t misaligned = 0;
 
-    // **Standard malloc/free benchmark**
-    clock_t start = clock();
-    for (size_t i = 0; i < num_allocations; i++) {
-        ptrs[i] = malloc(sizes[i]);
+    printf("Aligned allocation, %d blocks of each size %d times:\n", ALIGNED_BLOCKS, ALIGNED_ROUNDS);
+    printf("%-10s %-8s %16s %16s %14s\n", "Alignment", "Size", "posix_memalign ns", "mm_aligned ns", "mm overhead");
+    for (size_t a = 0; a < sizeof(alignments) / sizeof(alignments[0]); a++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            size_t alignment = alignments[a], size = sizes[s];
+            if (alignment > 4096 && size < 5000) continue;  // Not interesting: a whole aligned run either way
+
+            uint64_t start = monotonic_ns();
+            for (size_t round = 0; round < ALIGNED_ROUNDS; round++) {
+                for (size_t i = 0; i < ALIGNED_BLOCKS; i++) {
+                    if (posix_memalign(&ptrs[i], alignment, size) != 0) ptrs[i] = NULL;
+                }
+                for (size_t i = 0; i < ALIGNED_BLOCKS; i++) free(ptrs[i]);
+            }
+            double libc_ns = (double)(monotonic_ns() - start) / (ALIGNED_ROUNDS * ALIGNED_BLOCKS);
+
+            size_t usable = 0;
+            start = monotonic_ns();
+            for (size_t round = 0; round < ALIGNED_ROUNDS; round++) {
+                for (size_t i = 0; i < ALIGNED_BLOCKS; i++) {
+                    ptrs[i] = mm_aligned_alloc(alignment, size);
+                    if (!ptrs[i] || (uintptr_t)ptrs[i] % alignment) misaligned++;
+                }
+                if (round == 0) {
+                    for (size_t i = 0; i < ALIGNED_BLOCKS; i++) usable += mm_usable_size(ptrs[i]);
+                }
+                for (size_t i = 0; i < ALIGNED_BLOCKS; i++) mm_free(ptrs[i]);
+            }
+            double mm_ns = (double)(monotonic_ns() - start) / (ALIGNED_ROUNDS * ALIGNED_BLOCKS);
+
+            printf("%-10zu %-8zu %16.1f %16.1f %13.1f%%\n", alignment, size, libc_ns, mm_ns,
+                   100.0 * ((double)usable / ALIGNED_BLOCKS - size) / size);
+        }
     }
-    for (size_t i = 0; i < num_allocations; i++) {
-        free(ptrs[i]);
+    if (misaligned) {
+        printf("Aligned allocation FAILED: %zu blocks misaligned or missing\n", misaligned);
+        exit(1);
     }
-    clock_t end = clock();
-    printf("Standard malloc/free: %lf sec\n", (double)(end - start) / CLOCKS_PER_SEC);
+    printf("All blocks aligned.\n");
+}
 
-    // **Custom mm_malloc/mm_free benchmark (Preallocated)**
-    preallocate_memory(total_memory);  // Allocate memory for our allocator before benchmarking
+#define SHARING_OPS 2000000  // Push/pop pairs per thread
 
-    // Some options here to sleep before we do the memory manager test, in an attempt to play with caching
-    //sleep(1);
-    for (volatile int i = 0; i < 1000000000; i++);  // Waste CPU cycles instead of sleeping
+// The central state as it was before CentralList and CentralClass: one array per field, every class packed next
+// to its neighbours, so 8 classes share each cache line of list heads
+typedef struct {
+    TaggedList free_list[CHUNK_CLASSES];
+    size_t central_counts[CHUNK_CLASSES];
+} PackedCentral;
 
-    start = clock();
-    for (size_t i = 0; i < num_allocations; i++) {
-        ptrs[i] = mm_malloc(sizes[i]);
+static PackedCentral sharing_packed;
+static CentralList sharing_padded[CHUNK_CLASSES];
+
+typedef struct {
+    TaggedList *head;
+    size_t *count;
+    pthread_barrier_t *start;
+} SharingArgs;
+
+// What a central push and pop write: a CAS on the tagged head and an update of the count
+static void *sharing_thread(void *arg) {
+    SharingArgs *args = (SharingArgs *)arg;
+    pthread_barrier_wait(args->start);
+    for (size_t i = 0; i < SHARING_OPS; i++) {
+        TaggedList old = __atomic_load_n(args->head, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(args->head, &old, tagged_next(old, tagged_block(old)), 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        __atomic_fetch_add(args->count, i & 1 ? -1 : 1, __ATOMIC_RELAXED);
     }
-    for (size_t i = 0; i < num_allocations; i++) {
-        mm_free(ptrs[i], sizes[i]);
+    return NULL;
+}
+
+static double sharing_run(size_t num_threads, int padded) {
+    pthread_t threads[CHUNK_CLASSES];
+    SharingArgs args[CHUNK_CLASSES];
+    pthread_barrier_t start_barrier;
+    pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+    for (size_t t = 0; t < num_threads; t++) {
+        args[t].head = padded ? &sharing_padded[t].free_list : &sharing_packed.free_list[t];
+        args[t].count = padded ? &sharing_padded[t].central_count : &sharing_packed.central_counts[t];
+        args[t].start = &start_barrier;
+        pthread_create(&threads[t], NULL, sharing_thread, &args[t]);
     }
-    end = clock();
-    printf("Custom mm_malloc/mm_free: %lf sec\n", (double)(end - start) / CLOCKS_PER_SEC);
+    uint64_t start = monotonic_ns();
+    pthread_barrier_wait(&start_barrier);
+    for (size_t t = 0; t < num_threads; t++) pthread_join(threads[t], NULL);
+    double seconds = (monotonic_ns() - start) / 1e9;
+    pthread_barrier_destroy(&start_barrier);
+    return num_threads * SHARING_OPS / seconds;
+}
 
-    // Print memory allocation statistics
-    print_memory_stats(mem_manager.preallocated_counts, requested_counts);
+// One thread per chunk class, each only touching its own class's central state: with the packed
+// layout neighbouring classes still fight over cache lines, with CentralList they don't. Needs
+// as many CPUs as threads to show; on fewer the threads just take turns.
+void benchmark_false_sharing() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("False sharing of central class state, one thread per class, %d ops per thread (%ld CPUs):\n",
+           SHARING_OPS, cpus);
+    printf("%-8s %16s %16s %8s\n", "Threads", "packed ops/sec", "padded ops/sec", "Speedup");
+    // Doubling up to every class contending at once
+    for (size_t num_threads = 1;; num_threads *= 2) {
+        if (num_threads > CHUNK_CLASSES) num_threads = CHUNK_CLASSES;
+        double packed = sharing_run(num_threads, 0);
+        double padded = sharing_run(num_threads, 1);
+        printf("%-8zu %16.0f %16.0f %7.2fx\n", num_threads, packed, padded, padded / packed);
+        if (num_threads == CHUNK_CLASSES) break;
+    }
+}
 
-    free(sizes);
-    free(ptrs);
+#define POOL_OBJECTS 1000000  // Objects allocated, then freed, per round
+#define POOL_ROUNDS 5         // The best round counts
+
+typedef struct PoolNode {
+    struct PoolNode *left, *right;
+    uint64_t key;
+    double value;
+    uint32_t flags;
+} PoolNode;
+
+static void pool_node_init(void *obj, void *arg) {
+    (void)arg;
+    memset(obj, 0, sizeof(PoolNode));
+}
+
+// Millions of one struct through malloc, mm_malloc and an mm_pool (with and without a constructor
+// that zeroes each node), by pointer and with the class resolved at compile time. Also checks
+// size_class() and class_size() against the lookup tables.
+void benchmark_pool() {
+    mm_init();
+    for (size_t size = 1; size <= MAX_CHUNK_SIZE; size++) {
+        if (size_class(size) != get_chunk_index(size)) {
+            printf("size_class(%zu) is %zu, the lookup tables say %zu\n", size, size_class(size), get_chunk_index(size));
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+        if (class_size(i) != chunk_sizes[i]) {
+            printf("class_size(%zu) is %zu, chunk_sizes says %zu\n", i, class_size(i), chunk_sizes[i]);
+            exit(1);
+        }
+    }
+
+    void **objs = malloc(POOL_OBJECTS * sizeof(void *));
+    MMPool *pool = mm_pool_create(sizeof(PoolNode), _Alignof(PoolNode));
+    MMPool *zeroed = mm_pool_create(sizeof(PoolNode), _Alignof(PoolNode));
+    mm_pool_set_hooks(zeroed, pool_node_init, NULL, NULL);
+    static const char *names[] = { "malloc/free", "mm_malloc/mm_free", "mm_pool_alloc/free", "MM_POOL_ALLOC/FREE",
+                                   "  with constructor" };
+
+    printf("%d %zu byte objects allocated then freed, best of %d rounds:\n", POOL_OBJECTS, sizeof(PoolNode), POOL_ROUNDS);
+    for (int api = 0; api < 5; api++) {
+        double best_alloc = 0, best_free = 0;
+        for (int round = 0; round < POOL_ROUNDS; round++) {
+            uint64_t start = monotonic_ns();
+            for (size_t i = 0; i < POOL_OBJECTS; i++) {
+                objs[i] = api == 0 ? malloc(sizeof(PoolNode)) : api == 1 ? mm_malloc(sizeof(PoolNode)) :
+                          api == 2 ? mm_pool_alloc(pool) : api == 3 ? MM_POOL_ALLOC(pool, PoolNode) :
+                          MM_POOL_ALLOC(zeroed, PoolNode);
+                ((PoolNode *)objs[i])->key = i;
+            }
+            uint64_t middle = monotonic_ns();
+            for (size_t i = 0; i < POOL_OBJECTS; i++) {
+                if (api == 0) free(objs[i]);
+                else if (api == 1) mm_free(objs[i]);
+                else if (api == 2) mm_pool_free(pool, objs[i]);
+                else MM_POOL_FREE(api == 3 ? pool : zeroed, PoolNode, objs[i]);
+            }
+            double alloc_ns = (double)(middle - start) / POOL_OBJECTS, free_ns = (double)(monotonic_ns() - middle) / POOL_OBJECTS;
+            if (round == 0 || alloc_ns < best_alloc) best_alloc = alloc_ns;
+            if (round == 0 || free_ns < best_free) best_free = free_ns;
+        }
+        printf("  %-20s alloc %6.2f ns  free %6.2f ns\n", names[api], best_alloc, best_free);
+    }
+    mm_pool_destroy(pool);
+    mm_pool_destroy(zeroed);
+    free(objs);
+}
+
+#define REGION_REQUESTS 20000   // Simulated requests per API
+#define REGION_SHAPES 64        // Distinct requests, cycled through
+#define REGION_MAX_OBJECTS 600  // Objects allocated by the largest request
+
+// Each simulated request allocates a few hundred 16 to 256 byte objects (and now and then a 16KB
+// buffer), touches them and frees them all: one by one with free or mm_free, or with one mm_region_reset.
+void benchmark_region() {
+    mm_init();
+    static size_t sizes[REGION_SHAPES][REGION_MAX_OBJECTS];
+    static size_t counts[REGION_SHAPES];
+    void **objs = malloc(REGION_MAX_OBJECTS * sizeof(void *));
+    unsigned int seed = 25;
+    size_t total_objects = 0;
+    for (size_t shape = 0; shape < REGION_SHAPES; shape++) {
+        counts[shape] = 200 + rand_r(&seed) % (REGION_MAX_OBJECTS - 200 + 1);
+        for (size_t k = 0; k < counts[shape]; k++) {
+            sizes[shape][k] = k == 0 && shape % 8 == 0 ? 16384 : 16 + rand_r(&seed) % 241;
+        }
+    }
+    for (size_t r = 0; r < REGION_REQUESTS; r++) total_objects += counts[r % REGION_SHAPES];
+
+    static const char *names[] = { "malloc/free", "mm_malloc/mm_free", "mm_region" };
+    MMRegion *region = mm_region_create();
+    printf("%d requests of 200 to %d objects each:\n", REGION_REQUESTS, REGION_MAX_OBJECTS);
+    for (int api = 0; api < 3; api++) {
+        uint64_t checksum = 0;
+        uint64_t start = monotonic_ns();
+        for (size_t r = 0; r < REGION_REQUESTS; r++) {
+            size_t shape = r % REGION_SHAPES;
+            for (size_t k = 0; k < counts[shape]; k++) {
+                size_t size = sizes[shape][k];
+                objs[k] = api == 0 ? malloc(size) : api == 1 ? mm_malloc(size) : mm_region_alloc(region, size);
+                memset(objs[k], (int)k, 16);
+            }
+            for (size_t k = 0; k < counts[shape]; k++) checksum += ((unsigned char *)objs[k])[15] ^ (unsigned char)k;
+            if (api == 2) {
+                mm_region_reset(region);
+            } else {
+                for (size_t k = 0; k < counts[shape]; k++) {
+                    if (api == 0) free(objs[k]);
+                    else mm_free(objs[k]);
+                }
+            }
+        }
+        uint64_t elapsed = monotonic_ns() - start;
+        if (checksum) {
+            printf("%s: objects overlap\n", names[api]);
+            exit(1);
+        }
+        printf("  %-18s %8.2f us per request  %6.2f ns per object\n", names[api],
+               (double)elapsed / REGION_REQUESTS / 1000, (double)elapsed / total_objects);
+    }
+    mm_region_destroy(region);
+    free(objs);
+
+    MMStats stats;
+    mm_stats(&stats);
+    printf("Region chunks: %zu allocated, %zu bytes still held after mm_region_destroy\n", stats.large_allocs, stats.large_bytes);
 }
 
 ////////////// Testing Functions
@@ -224,38 +4276,319 @@ void consume_memory() {
 }
 
 // Multi-thread testing
+#define TEST_THREAD_ITERATIONS 100000
+
 void *thread_alloc(void *arg) {
-    for (int i = 0; i < 100000; i++) {
+    (void)arg;
+    for (int i = 0; i < TEST_THREAD_ITERATIONS; i++) {
         void *ptr = mm_malloc(128);
-        mm_free(ptr, 128);
+        mm_free(ptr);
     }
     return NULL;
 }
 
-void test_multithreading() {
-    pthread_t threads[4];
-    for (int i = 0; i < 4; i++) {
-        pthread_create(&threads[i], NULL, thread_alloc, NULL);
+// Stress testing of the central free lists
+#define STRESS_THREADS 16
+#define STRESS_ROUNDS 2000
+#define STRESS_BATCH 64      // Blocks each thread holds at once
+#define STRESS_CLASSES 29    // Stress chunk sizes 8 .. 4096
+
+static size_t stress_errors = 0;
+
+// Hold a batch of blocks of mixed sizes, stamp each one, give other threads a chance to run,
+// then check the stamps. A block handed to two threads at once gets the other thread's stamp.
+void *stress_alloc(void *arg) {
+    uint64_t id = (uintptr_t)arg;
+    unsigned int seed = (unsigned int)id;
+    void *ptrs[STRESS_BATCH];
+    size_t sizes[STRESS_BATCH];
+
+    for (uint64_t round = 0; round < STRESS_ROUNDS; round++) {
+        for (size_t k = 0; k < STRESS_BATCH; k++) {
+            sizes[k] = chunk_sizes[rand_r(&seed) % STRESS_CLASSES];
+            ptrs[k] = mm_malloc(sizes[k]);
+
+            uint64_t stamp = (id << 32) | (round * STRESS_BATCH + k);
+            memcpy(ptrs[k], &stamp, sizeof(stamp));
+            memcpy((char *)ptrs[k] + sizes[k] - sizeof(stamp), &stamp, sizeof(stamp));
+        }
+        if (round % 16 == 0) sched_yield();
+        for (size_t k = 0; k < STRESS_BATCH; k++) {
+            uint64_t stamp = (id << 32) | (round * STRESS_BATCH + k), first, last;
+            memcpy(&first, ptrs[k], sizeof(first));
+            memcpy(&last, (char *)ptrs[k] + sizes[k] - sizeof(last), sizeof(last));
+            if (first != stamp || last != stamp) {
+                __atomic_fetch_add(&stress_errors, 1, __ATOMIC_RELAXED);
+            }
+            mm_free(ptrs[k]);
+        }
+    }
+    return NULL;
+}
+
+// A batch of stamped blocks passed from a producer thread to a consumer thread
+typedef struct {
+    void *ptrs[STRESS_BATCH];
+    size_t sizes[STRESS_BATCH];
+    uint64_t stamps[STRESS_BATCH];
+} StressBatch;
+
+static StressBatch *stress_exchange;  // At most one batch in flight
+static size_t stress_consumed;
+
+static void stress_check_free(StressBatch *batch) {
+    for (size_t k = 0; k < STRESS_BATCH; k++) {
+        uint64_t first, last;
+        memcpy(&first, batch->ptrs[k], sizeof(first));
+        memcpy(&last, (char *)batch->ptrs[k] + batch->sizes[k] - sizeof(last), sizeof(last));
+        if (first != batch->stamps[k] || last != batch->stamps[k]) {
+            __atomic_fetch_add(&stress_errors, 1, __ATOMIC_RELAXED);
+        }
+        mm_free(batch->ptrs[k]);
+    }
+    mm_free(batch);
+}
+
+// Odd threads only allocate and stamp batches, even threads only check and free them, so their
+// caches fill up and the frees go back to the producers as remote frees
+void *stress_handoff(void *arg) {
+    uint64_t id = (uintptr_t)arg;
+    unsigned int seed = (unsigned int)id;
+
+    if (id % 2 == 0) {
+        while (__atomic_load_n(&stress_consumed, __ATOMIC_ACQUIRE) < STRESS_THREADS / 2 * STRESS_ROUNDS) {
+            StressBatch *batch = __atomic_exchange_n(&stress_exchange, NULL, __ATOMIC_ACQ_REL);
+            if (!batch) {
+                sched_yield();
+                continue;
+            }
+            stress_check_free(batch);
+            __atomic_fetch_add(&stress_consumed, 1, __ATOMIC_RELEASE);
+        }
+        return NULL;
+    }
+    for (uint64_t round = 0; round < STRESS_ROUNDS; round++) {
+        StressBatch *batch = mm_malloc(sizeof(StressBatch));
+        for (size_t k = 0; k < STRESS_BATCH; k++) {
+            batch->sizes[k] = chunk_sizes[rand_r(&seed) % STRESS_CLASSES];
+            batch->ptrs[k] = mm_malloc(batch->sizes[k]);
+            batch->stamps[k] = (id << 32) | (round * STRESS_BATCH + k);
+            memcpy(batch->ptrs[k], &batch->stamps[k], sizeof(uint64_t));
+            memcpy((char *)batch->ptrs[k] + batch->sizes[k] - sizeof(uint64_t), &batch->stamps[k], sizeof(uint64_t));
+        }
+        StressBatch *empty = NULL;
+        while (!__atomic_compare_exchange_n(&stress_exchange, &empty, batch, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            empty = NULL;
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static int compare_ptrs(const void *a, const void *b) {
+    uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+    return (x > y) - (x < y);
+}
+
+// With all other threads gone, every block the allocator ever created must be on exactly one free
+// list (central, this thread's cache or outbox, a remote queue or a per-CPU cache): none lost, none listed twice.
+static size_t verify_free_lists() {
+    size_t failures = 0;
+
+    for (size_t i = 0; i < CHUNK_CLASSES; i++) {
+        size_t expected = mem_manager.classes[i].preallocated + mem_manager.classes[i].fallback -
+                          mem_manager.classes[i].purged;
+        uintptr_t *seen = malloc((expected + 1) * sizeof(uintptr_t));
+        size_t found = 0;
+
+        // Stop one past the expected count so a cycle cannot loop forever
+        FreeBlock *lists[2 + REMOTE_OWNERS + MM_MAX_NODES] = { tcache.classes[i].free_list, tcache.outbox[i] };
+        for (size_t owner = 1; owner <= REMOTE_OWNERS; owner++) {
+            lists[1 + owner] = remote_queues[owner].heads[i];
+        }
+        for (size_t node = 0; node < (size_t)mm_numa_nodes; node++) {
+            lists[2 + REMOTE_OWNERS + node] = tagged_block(mem_manager.lists[node][i].free_list);
+        }
+        for (size_t l = 0; l < 2 + REMOTE_OWNERS + (size_t)mm_numa_nodes; l++) {
+            for (FreeBlock *block = lists[l]; block && found <= expected; block = block->next) {
+                seen[found++] = (uintptr_t)block;
+            }
+        }
+        long cpus = sysconf(_SC_NPROCESSORS_CONF);
+        for (long cpu = 0; percpu_caches && cpu < cpus && cpu < PERCPU_MAX_CPUS; cpu++) {
+            for (size_t n = 0; n < percpu_caches[cpu].counts[i] && found <= expected; n++) {
+                seen[found++] = (uintptr_t)percpu_caches[cpu].slots[i][n];
+            }
+        }
+
+        qsort(seen, found, sizeof(uintptr_t), compare_ptrs);
+        size_t duplicates = 0;
+        for (size_t n = 1; n < found; n++) {
+            if (seen[n] == seen[n - 1]) duplicates++;
+        }
+        if (found != expected || duplicates) {
+            printf("  chunk size %zu: expected %zu free blocks, found %zu (%zu duplicates)\n",
+                   chunk_sizes[i], expected, found, duplicates);
+            failures++;
+        }
+        free(seen);
+    }
+
+    // The page heap's mask of non-empty bins has to agree with the bins
+    for (size_t bin = 0; bin < RUN_BINS; bin++) {
+        int marked = (page_heap.run_bin_mask[bin / 64] >> (bin % 64)) & 1;
+        if (marked != (page_heap.run_bins[bin] != NULL)) {
+            printf("  page run bin %zu: %s but marked %s\n", bin, page_heap.run_bins[bin] ? "not empty" : "empty",
+                   marked ? "not empty" : "empty");
+            failures++;
+        }
+    }
+    return failures;
+}
+
+// A slab released by the purger goes back to the page heap and can be carved for another class.
+// Half of such a slab in use must survive a purge of its class and of the page heap.
+static void stress_purge_reuse() {
+    size_t old_class = get_chunk_index(4096), new_class = get_chunk_index(2048);
+    size_t old_blocks = 16 * PAGE_SIZE / block_stride(old_class), new_blocks = 16 * PAGE_SIZE / block_stride(new_class);
+    FreeBlock *tail, *held[16 * PAGE_SIZE / 2048];
+    size_t count, num_held = new_blocks / 2;
+
+    pthread_mutex_lock(&purge_lock);  // Keep the purger thread out
+    if (!carve_slab(old_class, old_blocks, 0)) exit(1);
+    __atomic_fetch_add(&mem_manager.classes[old_class].fallback, old_blocks, __ATOMIC_RELAXED);
+    purge_class(tcache.node, old_class);
+    if (!carve_slab(new_class, new_blocks, 0)) exit(1);
+    __atomic_fetch_add(&mem_manager.classes[new_class].fallback, new_blocks, __ATOMIC_RELAXED);
+
+    // The new slab is at the head of its central list: take its first half and stamp it
+    FreeBlock *block = central_pop_node(tcache.node, new_class, SIZE_MAX, &tail, &count);
+    for (size_t k = 0; k < num_held; k++, block = block->next) held[k] = block;
+    central_push(new_class, block, tail, count - num_held);
+    for (size_t k = 0; k < num_held; k++) memset(held[k], 0xa5, chunk_sizes[new_class]);
+
+    purge_class(tcache.node, new_class);
+    purge_page_heap(now_ms(), 0);
+    size_t lost = 0;
+    for (size_t k = 0; k < num_held; k++) {
+        for (size_t n = 0; n < chunk_sizes[new_class]; n++) {
+            if (((unsigned char *)held[k])[n] != 0xa5) {
+                lost++;
+                break;
+            }
+        }
+    }
+    if (lost || pagemap_class(held[0]) != new_class + 1) {
+        // Its blocks are on the page heap now, checking the free lists makes no sense
+        printf("Free list stress test FAILED: purger released a %zu byte slab with %zu blocks in use (%zu clobbered)\n",
+               chunk_sizes[new_class], num_held, lost);
+        exit(1);
+    }
+    for (size_t k = 0; k + 1 < num_held; k++) held[k]->next = held[k + 1];
+    central_push(new_class, held[0], held[num_held - 1], num_held);
+    pthread_mutex_unlock(&purge_lock);
+}
+
+void stress_free_lists() {
+    pthread_t threads[STRESS_THREADS];
+
+    printf("Stressing free lists with %d threads...\n", STRESS_THREADS);
+    for (uintptr_t i = 0; i < STRESS_THREADS; i++) {
+        pthread_create(&threads[i], NULL, stress_alloc, (void *)(i + 1));
+    }
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Again with blocks freed by other threads than the ones that allocated them
+    for (uintptr_t i = 0; i < STRESS_THREADS; i++) {
+        pthread_create(&threads[i], NULL, stress_handoff, (void *)(i + 1));
     }
-    for (int i = 0; i < 4; i++) {
+    for (int i = 0; i < STRESS_THREADS; i++) {
         pthread_join(threads[i], NULL);
     }
+
+    // And both again on per-CPU caches, where rseq is available
+    if (mm_set_percpu(1)) {
+        printf("Again with per-CPU caches...\n");
+        stress_consumed = 0;
+        for (int pass = 0; pass < 2; pass++) {
+            for (uintptr_t i = 0; i < STRESS_THREADS; i++) {
+                pthread_create(&threads[i], NULL, pass ? stress_handoff : stress_alloc, (void *)(i + 1));
+            }
+            for (int i = 0; i < STRESS_THREADS; i++) {
+                pthread_join(threads[i], NULL);
+            }
+        }
+    }
+    mm_set_percpu(0);
+    stress_purge_reuse();
+
+    size_t failures = verify_free_lists();
+    if (stress_errors || failures) {
+        printf("Free list stress test FAILED: %zu blocks handed out twice, %zu lists inconsistent\n",
+               stress_errors, failures);
+        exit(1);
+    }
+    printf("Free list stress test passed: no block lost or handed out twice.\n");
+}
+
+// Run the 128 byte churn on a growing number of threads to see how it scales
+void test_multithreading() {
+    static const int thread_counts[] = {1, 4, 16, 64};
+    pthread_t threads[64];
+
+    printf("Multi-threaded mm_malloc/mm_free (128 bytes, %d iterations per thread):\n", TEST_THREAD_ITERATIONS);
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        int num_threads = thread_counts[t];
+        struct timespec start, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < num_threads; i++) {
+            pthread_create(&threads[i], NULL, thread_alloc, NULL);
+        }
+        for (int i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("  %2d threads: %lf sec, %.0f ops/sec\n", num_threads, elapsed,
+               2.0 * num_threads * TEST_THREAD_ITERATIONS / elapsed);
+    }
+
+    stress_free_lists();
 }
 ////////////// End testing functions
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        printf("Usage: %s [-c] [-f] [-p] [-m] [-t] [-b]\n", argv[0]);
+        printf("Usage: %s [-c] [-f] [-p] [-m] [-t] [-l] [-r] [-H] [-d] [-j] [-P file] [-T trace] [-x pattern[:threads]] [-N] [-C threads] [-a] [-F] [-o] [-R] [-b]\n", argv[0]);
         printf("Options:\n");
         printf("  -c  Clear CPU Cache\n");
         printf("  -f  Fragment Memory\n");
         printf("  -p  Force Page Faults\n");
         printf("  -m  Simulate Memory Pressure\n");
         printf("  -t  Multi-Threaded Test\n");
+        printf("  -l  Large Allocation Benchmark\n");
+        printf("  -r  Realloc Growth Benchmark\n");
+        printf("  -H  Huge Page Random Access Benchmark\n");
+        printf("  -d  Decay Purging Benchmark\n");
+        printf("  -j  Print mm_stats() as JSON after the benchmark\n");
+        printf("  -P  Preallocate from a demand profile file, and save the run's profile to it\n");
+        printf("  -T  Replay an allocation trace against malloc and mm_malloc\n");
+        printf("  -x  Cross-Thread Benchmark: churn, pc (producer/consumer), a2a (all-to-all) or all, up to N threads\n");
+        printf("  -N  NUMA Local vs. Remote Bandwidth Benchmark\n");
+        printf("  -C  Thread vs. Per-CPU Cache Memory Benchmark, up to N live threads\n");
+        printf("  -a  Aligned Allocation Benchmark\n");
+        printf("  -F  False Sharing Benchmark (packed vs. cache line aligned class state)\n");
+        printf("  -o  Object Pool Benchmark\n");
+        printf("  -R  Region Benchmark (bump allocation and bulk reset vs. per-object free)\n");
         printf("  -b  Run Benchmark (Default if no options)\n");
         return 1;
     }
 
+    int print_json = 0;
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-c") == 0) {
             clear_cpu_cache();
@@ -272,6 +4605,34 @@ int main(int argc, char *argv[]) {
             consume_memory();
         } else if (strcmp(argv[i], "-t") == 0) {
             test_multithreading();
+        } else if (strcmp(argv[i], "-l") == 0) {
+            benchmark_large();
+        } else if (strcmp(argv[i], "-r") == 0) {
+            benchmark_realloc();
+        } else if (strcmp(argv[i], "-H") == 0) {
+            benchmark_huge_pages();
+        } else if (strcmp(argv[i], "-d") == 0) {
+            benchmark_decay();
+        } else if (strcmp(argv[i], "-j") == 0) {
+            print_json = 1;
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+            profile_path = argv[++i];
+        } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            replay_trace(argv[++i]);
+        } else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+            benchmark_cross_thread(argv[++i]);
+        } else if (strcmp(argv[i], "-N") == 0) {
+            benchmark_numa();
+        } else if (strcmp(argv[i], "-a") == 0) {
+            benchmark_aligned();
+        } else if (strcmp(argv[i], "-F") == 0) {
+            benchmark_false_sharing();
+        } else if (strcmp(argv[i], "-o") == 0) {
+            benchmark_pool();
+        } else if (strcmp(argv[i], "-R") == 0) {
+            benchmark_region();
+        } else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+            benchmark_cache_modes(strtoul(argv[++i], NULL, 10));
         } else if (strcmp(argv[i], "-b") == 0) {
             ;
         } else {
@@ -281,5 +4642,12 @@ int main(int argc, char *argv[]) {
     }
 
     benchmark(TOTAL_MEMORY);  // Benchmark with 10MB worth of allocations
+
+    if (print_json) {
+        MMStats stats;
+        mm_stats(&stats);
+        mm_stats_json(&stats, stdout);
+    }
     return 0;
 }
+#endif  // MM_PRELOAD
@@ -1,6 +1,9 @@
 #sh
 
+gcc -O2 -pthread main.c
+gcc -O2 -pthread -shared -fPIC -fvisibility=hidden -DMM_PRELOAD main.c -o libmm.so
+
 ./a.out
 LD_PRELOAD=/usr/lib/libtcmalloc.so ./a.out
 LD_PRELOAD=/usr/lib/libjemalloc.so ./a.out
-
+LD_PRELOAD=./libmm.so ./a.out